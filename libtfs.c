@@ -0,0 +1,5401 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *	
+ *	Tiny File System
+ *
+ *	File:	libtfs.c
+ *  Author: Yujie REN
+ *	Date:	April 2019
+ *
+ *	The file system itself, without FUSE. tfs.c mounts it through FUSE,
+ *	anything else can link this in and call the libtfs_*() functions directly.
+ *
+ */
+
+#define _GNU_SOURCE				// for O_DIRECT
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "libtfs.h"
+
+#define TFS_NBLOCKS		((DISK_SIZE) / BLOCK_SIZE)		// total number of blocks in the disk file
+#define CSUM_PER_BLK		(BLOCK_SIZE / sizeof(uint32_t))		// checksums that fit into one block of the checksum area
+
+/*
+ * Extended superblock. It lives in block #0 right behind struct superblock (which we can't change),
+ * so images made before this existed simply read back zeroes here and get no extra features.
+ */
+#define TFS_EXT_MAGIC		0x54465358				// "TFSX"
+#define TFS_FEAT_CSUM		0x1					// metadata blocks carry a CRC32C checksum
+#define TFS_FEAT_REFCOUNT	0x2					// data blocks can be shared between files (clones)
+#define TFS_FEAT_DEDUP		0x4					// there is a content hash -> block index for deduplication
+#define TFS_FEAT_AGROUPS	0x8					// the disk is split into allocation groups (see struct tfs_group)
+#define TFS_FEAT_STRIPED	0x10					// the block address space is striped over several backing files
+#define TFS_FEAT_METAFILE	0x20					// metadata lives in a backing file of its own
+#define TFS_FEAT_JOURNAL	0x40					// metadata changes go through the journal area first
+
+#define TFS_STATE_DEDUP_DIRTY	0x1					// the dedup index on disk is stale, throw it away at mount
+
+struct superblock_ext {
+	uint32_t	ext_magic;
+	uint32_t	features;
+	uint32_t	csum_start_blk;		// first block of the checksum area (one uint32_t per disk block)
+	uint32_t	csum_nblks;		// how many blocks the checksum area takes up
+	uint32_t	d_end_blk;		// data blocks live in [d_start_blk, d_end_blk)
+	uint32_t	ref_start_blk;		// first block of the reference count area (one byte per disk block)
+	uint32_t	ref_nblks;		// how many blocks the reference count area takes up
+	uint32_t	dedup_start_blk;	// first block of the dedup index
+	uint32_t	dedup_nblks;		// how many blocks the dedup index takes up
+	uint32_t	state;			// TFS_STATE_* bits, rewritten while mounted
+	uint32_t	ag_count;		// number of allocation groups, they start right after the superblock
+	uint32_t	ag_nblks;		// blocks per allocation group
+	uint32_t	ag_inodes;		// inodes per allocation group
+	uint32_t	stripe_count;		// backing files the image is striped over (TFS_FEAT_STRIPED)
+	uint32_t	stripe_unit;		// consecutive blocks that go to the same backing file
+	uint32_t	journal_start_blk;	// first block of the journal area (TFS_FEAT_JOURNAL)
+	uint32_t	journal_nblks;		// how many blocks the journal area takes up
+};
+
+#define TFS_AG_COUNT		8					// allocation groups tfs_mkfs() makes
+#define TFS_DISCARD_BATCH	64					// freed blocks collected before they're punched out of the disk file
+#define TFS_MAX_STRIPES		16					// backing files a striped image can use
+#define TFS_STRIPE_UNIT		16					// default stripe unit in blocks (64KB, a whole file)
+#define TFS_IO_WORKERS		4					// I/O workers sharing DISKFILE when the image isn't striped
+#define TFS_MAINT_SECS		60					// how often the maintenance thread makes a pass
+#define TFS_MAINT_RATE		256					// default blocks per second a pass may rewrite
+#define TFS_MAINT_RETIRE	256					// blocks moved files leave behind until the next pass
+#define TFS_EXTENT_GRACE_SECS	2					// how long a freed block libtfs_read_extents() may have handed out stays unused
+#define TFS_FAULT_REORDER	64					// most writes libtfs_set_fault() can reorder at a crash
+#define TFS_JOURNAL_NBLKS	128					// journal area tfs_mkfs() makes: a header and up to 127 logged blocks
+
+/*
+ * Timestamp-only changes (atime on a read, mtime/ctime of a directory that got a new entry, utimens...) aren't
+ * written to the inode table right away. They wait here until the inode's block is written anyway, the file
+ * system is flushed, or a call finishes after TFS_ITIME_FLUSH_SECS have gone by.
+ */
+#define TFS_ITIME_FLUSH_SECS	30
+#define TFS_RELATIME_SECS	(24 * 60 * 60)		// atime is refreshed at least this often, even if nothing changed
+
+#define ITIME_ATIME		0x1
+#define ITIME_MTIME		0x2
+#define ITIME_CTIME		0x4
+
+struct tfs_itime {
+	int		dirty;
+	struct timespec	atime;
+	struct timespec	mtime;
+	struct timespec	ctime;
+};
+
+/*
+ * Bloom filter of the names in a directory. It lives in the directory inode's indirect_ptr words (directories
+ * don't use them): BLOOM_WORDS words of bits, then a header word with BLOOM_MAGIC on top and, below it, how
+ * many names were removed since the filter was last built. Like timestamps, changes are kept in memory and go
+ * to disk whenever the inode table block is written.
+ */
+#define BLOOM_WORDS		7
+#define BLOOM_BITS		(BLOOM_WORDS * 32)			// 224 bits, under 1% false positives for a full block of 16 names
+#define BLOOM_K			3					// bits set per name
+#define BLOOM_MAGIC		0xB10F0000
+#define BLOOM_STALE		16					// removals before the filter is rebuilt
+
+#define BLOOM_UNKNOWN		0					// not looked at since mount
+#define BLOOM_CLEAN		1
+#define BLOOM_DIRTY		2					// newer than the inode on disk
+
+struct tfs_bloom {
+	int		state;
+	uint32_t	words[BLOOM_WORDS + 1];			// same layout as in indirect_ptr
+};
+
+/*
+ * Directory blocks hold 16 struct dirent by value. Slots that were never used are all zeroes, and nothing comes
+ * after the first one. A removed entry keeps its name with valid = 0 until dir_add() reuses the slot.
+ */
+#define DIRENT_UNUSED(d)	((d)->name[0] == '\0')
+
+/*
+ * Allocation group. Each one has its own inode bitmap, data bitmap, slice of the inode table and data region,
+ * so a file's inode, bitmaps and data stay close together and allocations in different groups never touch the
+ * same bitmap block. Calls are serialized by fs->lock, so the groups need no locks of their own.
+ * Images made before allocation groups are a single group laid out the old way: bitmaps in blocks #1 and #2,
+ * the inode table from #3 and data from #67.
+ */
+struct tfs_group {
+	int		ibitmap_blk;
+	int		dbitmap_blk;
+	int		itable_blk;		// first block of this group's inode table slice
+	int		data_blk;		// first data block, the data bitmap is relative to it
+	int		data_nblks;
+	int		first_ino;		// inode numbers [first_ino, first_ino + ninodes) live here
+	int		ninodes;
+	int		free_inodes;		// counted at mount, kept up to date by the allocators
+	int		free_blks;
+};
+
+/*
+ * A worker thread that does its share of dev_rw_many(). A striped image has one per backing file, with that
+ * file's path and descriptor; otherwise TFS_IO_WORKERS of them share DISKFILE.
+ */
+struct stripe_job {
+	struct tfs_fs*		fs;
+	int			write;
+	const int*		blks;
+	char* const*		bufs;
+	char*			failed;
+	int			count;
+};
+
+struct tfs_stripe {
+	char			path[PATH_MAX];
+	int			fd;
+	pthread_t		worker;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;			// signalled when job is handed over and when it's done
+	const struct stripe_job* job;			// what the worker is doing, NULL when it's idle
+	int			quit;
+};
+
+/*
+ * Fault injection state, see libtfs_set_fault(). While it's set, every block write of the handle goes through
+ * fault_pwrite() one at a time. The last conf.reorder writes are remembered with what they overwrote, so a
+ * crash can take a random subset of them back, the way a write cache that doesn't keep order would lose them.
+ */
+struct fault_undo {
+	int		fd;
+	off_t		pos;
+	char*		old_data;		// the block before the write
+	char*		new_data;		// what the write put there
+};
+
+struct tfs_fault_state {
+	struct tfs_fault	conf;
+	pthread_mutex_t		lock;
+	unsigned		seed;			// rand_r() state
+	long			written;		// writes that reached the disk so far
+	int			crashed;		// every write from now on is dropped
+	struct fault_undo	undo[TFS_FAULT_REORDER];	// ring of the last conf.reorder writes, in undo[0..conf.reorder)
+	int			undo_next;
+	int			undo_count;
+};
+
+/*
+ * Metadata journal (TFS_FEAT_JOURNAL). While fs->lock is held, metadata block writes are collected in fs->jnl
+ * instead of going to disk, and metadata reads find them there. Releasing the lock commits them: the blocks go
+ * to the journal area behind a header listing where they belong, then to their real places. Mount replays the
+ * last commit if its header and every logged block check out, so each call's metadata changes are on disk
+ * either all or not at all. File data isn't logged, it's written in place before the commit.
+ */
+#define JOURNAL_MAGIC		0x54464a4c				// "TFJL"
+#define JOURNAL_MAX		(TFS_JOURNAL_NBLKS - 1)
+
+struct journal_hdr {
+	uint32_t	magic;
+	uint32_t	count;			// blocks logged behind the header
+	uint32_t	seq;			// commits since mount, for whoever looks at an image by hand
+	uint32_t	csum;			// block_csum() of the header block with this field zeroed
+	uint32_t	blks[JOURNAL_MAX];	// where each logged block belongs
+	uint32_t	csums[JOURNAL_MAX];	// and its checksum, a commit torn by a crash doesn't match
+};
+
+struct tfs_journal {
+	int		count;
+	int		blks[JOURNAL_MAX];
+	char*		bufs[JOURNAL_MAX];	// allocated the first time a slot is used, then kept
+	uint32_t	seq;
+};
+
+/*
+ * direct_ptr encoding for regular files. Block numbers fit into the low 24 bits; the flags above them
+ * say how a compressed chunk is laid out. Directories only ever hold plain block numbers (or -1).
+ */
+#define PTR_BLK(p)		((p) & 0xFFFFFF)
+#define PTR_ZHEAD		(1 << 24)		// first physical block of a compressed chunk, starts with struct zchunk_hdr
+#define PTR_ZCONT		(1 << 25)		// another physical block of the same compressed chunk
+#define PTR_ZNONE		(1 << 26)		// logical block covered by a compressed chunk, no physical block of its own
+#define PTR_UNWRITTEN		(1 << 27)		// preallocated by fallocate, owns its block but reads back as zeroes
+#define PTR_IS_BLK(p)		((p) != -1 && !((p) & PTR_ZNONE))	// does this slot own a physical block?
+
+#define ZCHUNK_BLKS		4					// logical blocks per compression chunk
+#define ZCHUNK_SIZE		(ZCHUNK_BLKS * BLOCK_SIZE)
+#define ZCHUNK_MAGIC		0x5A43					// "ZC"
+
+struct zchunk_hdr {
+	uint16_t	magic;		// catches a pointer that lost its flags
+	uint16_t	ulen;		// bytes of file data in the chunk
+	uint16_t	clen;		// bytes of LZ4 data following this header
+	uint16_t	pad;
+};
+
+/*
+ * Dedup index entry. The index is a fixed-size open-addressing table: a lookup only ever looks at the
+ * DEDUP_PROBE slots after the home slot, and an insert that finds them all full evicts the home slot.
+ */
+#define DEDUP_PER_BLK		(BLOCK_SIZE / sizeof(struct dedup_entry))
+#define DEDUP_NBLKS		16					// 4096 entries, 64KB of memory
+#define DEDUP_SLOTS		(DEDUP_NBLKS * DEDUP_PER_BLK)
+#define DEDUP_PROBE		8
+#define DEDUP_NO_SLOT		0xFFFF
+
+struct dedup_entry {
+	uint64_t	hash;
+	uint32_t	blk;		// 0 means empty (block #0 is the superblock, never file data)
+	uint32_t	pad;
+};
+
+/*
+ * Everything one mounted image needs. All of the functions below work on the handle they're given,
+ * so a program can have several images open at once.
+ */
+struct tfs_fs {
+	char			diskfile_path[PATH_MAX];
+	int			dev_fd;			// our descriptor on the disk file
+	struct tfs_options	opts;
+	struct superblock_ext	sb_ext;
+	struct tfs_stats	stats;
+	uint32_t*		csum_table;		// in-memory copy of the checksum area, indexed by block number
+	uint8_t*		ref_table;		// in-memory copy of the reference count area, indexed by block number
+	struct dedup_entry*	dedup_table;		// in-memory copy of the dedup index
+	uint16_t*		dedup_slot_of;		// block number -> dedup index slot, so freed blocks can be dropped quickly
+	char*			dedup_dirty;		// which dedup index blocks need writing back
+	struct tfs_group*	groups;
+	int			ngroups;
+	struct tfs_itime*	itimes;			// timestamp changes not written back yet, indexed by inode number
+	int			itimes_dirty;
+	time_t			itimes_flushed;		// when they were last written back
+	int*			discard_blks;		// freed data blocks waiting to be punched out (sparse option)
+	int			discard_count;
+	int			discard_max;		// room in discard_blks, it grows when one call frees more than a batch
+	int*			held_blks;		// data blocks the current call freed, released when it commits
+	int			nheld;
+	int			held_max;
+	time_t			extents_at;		// when libtfs_read_extents() last handed out extents
+	time_t*			reuse_at;		// per block, when a freed block may be allocated again (NULL until extents are handed out)
+	struct tfs_stripe*	stripes;		// backing files with the stripes option, stripes[0] is DISKFILE
+	int			nstripes;		// 0 when the image lives in DISKFILE alone
+	int			nworkers;		// I/O workers in stripes[], one per backing file or TFS_IO_WORKERS
+	int			stripe_unit;
+	int			meta_fd;		// the meta option's backing file, -1 when metadata shares DISKFILE
+	pthread_mutex_t		lock;			// held by every libtfs_*() call, and by the maintenance thread while it works on an inode
+	pthread_t		maint_thread;
+	pthread_cond_t		maint_cond;		// wakes the maintenance thread up for unmount
+	int			maint_running;
+	int			maint_quit;
+	int			maint_budget;		// blocks the current pass may still rewrite this second
+	int			retired[TFS_MAINT_RETIRE];	// where moved files used to be, freed by the next pass
+	int			nretired;
+	struct tfs_bloom	blooms[MAX_INUM];	// directory Bloom filters, indexed by inode number
+	int			blooms_dirty;
+	struct tfs_fault_state*	fault;			// libtfs_set_fault(), NULL unless a test turned it on
+	struct tfs_journal*	jnl;			// metadata writes of the current call, NULL on images without a journal
+};
+
+/*
+ * CRC32C (Castagnoli) kernels
+ */
+#define CRC32C_POLY		0x82f63b78		// reflected Castagnoli polynomial
+#define CRC32C_LANE		(BLOCK_SIZE / 3 / 8 * 8)	// bytes per lane when a block is split into three interleaved streams
+
+static uint32_t crc32c_tables[8][256];		// slicing-by-8 tables for the portable kernel
+static uint32_t crc32c_lane_shift;		// x^(8 * CRC32C_LANE - 33) mod P, used to stitch the three lanes back together
+static uint32_t (*crc32c_kernel)(uint32_t crc, const void* buf, size_t len) = NULL;
+
+/*
+ * Multiply two polynomials modulo the CRC polynomial (both in reflected form).
+ */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+	uint32_t m = (uint32_t)1 << 31;
+	uint32_t p = 0;
+	while(m != 0){
+		if(a & m){
+			p ^= b;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/*
+ * Compute x^n modulo the CRC polynomial.
+ */
+static uint32_t crc32c_xpow(uint64_t n) {
+	uint32_t result = (uint32_t)1 << 31;		// x^0
+	uint32_t square = (uint32_t)1 << 30;		// x^1
+	while(n != 0){
+		if(n & 1){
+			result = crc32c_multmodp(square, result);
+		}
+		square = crc32c_multmodp(square, square);
+		n >>= 1;
+	}
+	return result;
+}
+
+/*
+ * Portable slicing-by-8 kernel, used when the CPU has no CRC32 instruction.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const void* buf, size_t len) {
+	const unsigned char* p = (const unsigned char*)buf;
+	while(len >= 8){
+		uint32_t lo = 0;
+		uint32_t hi = 0;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = crc32c_tables[7][lo & 0xff] ^ crc32c_tables[6][(lo >> 8) & 0xff] ^
+		      crc32c_tables[5][(lo >> 16) & 0xff] ^ crc32c_tables[4][lo >> 24] ^
+		      crc32c_tables[3][hi & 0xff] ^ crc32c_tables[2][(hi >> 8) & 0xff] ^
+		      crc32c_tables[1][(hi >> 16) & 0xff] ^ crc32c_tables[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while(len-- > 0){
+		crc = crc32c_tables[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+/*
+ * SSE4.2 kernel: one CRC32 instruction per 8 bytes.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void* buf, size_t len) {
+	const unsigned char* p = (const unsigned char*)buf;
+	uint64_t c = crc;
+	while(len >= 8){
+		uint64_t word = 0;
+		memcpy(&word, p, 8);
+		c = _mm_crc32_u64(c, word);
+		p += 8;
+		len -= 8;
+	}
+	while(len-- > 0){
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	}
+	return (uint32_t)c;
+}
+
+/*
+ * SSE4.2 + PCLMUL kernel. The CRC32 instruction has a 3 cycle latency but a throughput of one per cycle,
+ * so a block is cut into three lanes that are checksummed side by side. The partial CRCs are then
+ * shifted into place with a carry-less multiply and folded together.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_pclmul(uint32_t crc, const void* buf, size_t len) {
+	if(len < 3 * CRC32C_LANE){
+		return crc32c_sse42(crc, buf, len);
+	}
+
+	const unsigned char* p = (const unsigned char*)buf;
+	uint64_t c0 = crc;
+	uint64_t c1 = 0;
+	uint64_t c2 = 0;
+	size_t i = 0;
+	for(i = 0; i < CRC32C_LANE; i += 8){
+		uint64_t w0 = 0;
+		uint64_t w1 = 0;
+		uint64_t w2 = 0;
+		memcpy(&w0, p + i, 8);
+		memcpy(&w1, p + CRC32C_LANE + i, 8);
+		memcpy(&w2, p + 2 * CRC32C_LANE + i, 8);
+		c0 = _mm_crc32_u64(c0, w0);
+		c1 = _mm_crc32_u64(c1, w1);
+		c2 = _mm_crc32_u64(c2, w2);
+	}
+
+	// crc(A || B) = crc(A) * x^(8 * len(B)) ^ crc(B), and the multiply-then-reduce below is exactly that shift.
+	__m128i k = _mm_cvtsi32_si128((int)crc32c_lane_shift);
+	uint64_t shifted = (uint64_t)_mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_cvtsi32_si128((int)(uint32_t)c0), k, 0));
+	c1 ^= _mm_crc32_u64(0, shifted);
+	shifted = (uint64_t)_mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_cvtsi32_si128((int)(uint32_t)c1), k, 0));
+	c2 ^= _mm_crc32_u64(0, shifted);
+
+	// Whatever didn't fit evenly into the three lanes.
+	return crc32c_sse42((uint32_t)c2, p + 3 * CRC32C_LANE, len - 3 * CRC32C_LANE);
+}
+#endif
+
+/*
+ * Build the lookup tables and pick the fastest kernel this CPU supports.
+ */
+static void crc32c_init() {
+	int n = 0;
+	for(n = 0; n < 256; n++){
+		uint32_t crc = n;
+		int bit = 0;
+		for(bit = 0; bit < 8; bit++){
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_tables[0][n] = crc;
+	}
+	for(n = 0; n < 256; n++){
+		int t = 1;
+		for(t = 1; t < 8; t++){
+			crc32c_tables[t][n] = crc32c_tables[0][crc32c_tables[t - 1][n] & 0xff] ^ (crc32c_tables[t - 1][n] >> 8);
+		}
+	}
+	crc32c_lane_shift = crc32c_xpow(8 * CRC32C_LANE - 33);
+
+	crc32c_kernel = crc32c_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2")){
+		crc32c_kernel = crc32c_sse42;
+		if(__builtin_cpu_supports("pclmul")){
+			crc32c_kernel = crc32c_pclmul;
+		}
+	}
+#endif
+}
+
+/*
+ * Checksum of one disk block. Zero is reserved for "no checksum recorded", so a block whose
+ * CRC really is zero just never gets verified.
+ */
+static uint32_t block_csum(const void* buf) {
+	return ~crc32c_kernel(~(uint32_t)0, buf, BLOCK_SIZE);
+}
+
+/*
+ * Block buffer pool. Every thread keeps a few BLOCK_SIZE-aligned buffers around, so the hot paths don't
+ * go through malloc()/free() for each block they touch, and the buffers can be handed to O_DIRECT as is.
+ */
+#define BLKBUF_POOL_MAX		16			// buffers cached per thread
+
+struct blkbuf_pool {
+	void*	bufs[BLKBUF_POOL_MAX];
+	int	count;
+};
+
+static __thread struct blkbuf_pool blkbuf_pool;
+static pthread_key_t blkbuf_key;			// only there so a thread's buffers get freed when it exits
+static pthread_once_t blkbuf_key_once = PTHREAD_ONCE_INIT;
+
+static void blkbuf_pool_drain(void* pool) {
+	struct blkbuf_pool* p = (struct blkbuf_pool*)pool;
+	while(p->count > 0){
+		free(p->bufs[--p->count]);
+	}
+}
+
+static void blkbuf_key_init() {
+	pthread_key_create(&blkbuf_key, blkbuf_pool_drain);
+}
+
+/*
+ * Aligned allocation for anything the disk reads into directly (chunk buffers, the in-memory tables).
+ */
+static void* blkbuf_alloc(size_t size) {
+	void* buf = NULL;
+	if(posix_memalign(&buf, BLOCK_SIZE, size) != 0){
+		return NULL;
+	}
+	return buf;
+}
+
+static void* blkbuf_zalloc(size_t size) {
+	void* buf = blkbuf_alloc(size);
+	if(buf != NULL){
+		memset(buf, 0, size);
+	}
+	return buf;
+}
+
+/*
+ * Get one block-sized, block-aligned buffer. Its contents are whatever the last user left in it.
+ */
+static void* blkbuf_get() {
+	if(blkbuf_pool.count > 0){
+		return blkbuf_pool.bufs[--blkbuf_pool.count];
+	}
+	pthread_once(&blkbuf_key_once, blkbuf_key_init);
+	pthread_setspecific(blkbuf_key, &blkbuf_pool);
+	return blkbuf_alloc(BLOCK_SIZE);
+}
+
+static void blkbuf_put(void* buf) {
+	if(buf == NULL){
+		return;
+	}
+	if(blkbuf_pool.count < BLKBUF_POOL_MAX){
+		blkbuf_pool.bufs[blkbuf_pool.count++] = buf;
+		return;
+	}
+	free(buf);
+}
+
+/*
+ * Block device access. Every handle keeps its own descriptor on the disk file (block.c only has room for one),
+ * opened with O_DIRECT under the odirect mount option so blocks aren't cached a second time in the host page cache.
+ *
+ * With the stripes option the block address space is spread over several backing files instead: stripe_unit
+ * blocks go to DISKFILE, the next stripe_unit to the second file and so on, round and round. dev_fd is then the
+ * descriptor of the first one, and each file gets a worker thread so dev_rw_many() can keep all of them busy.
+ * An image in DISKFILE alone gets a small pool of workers instead, which split multi-block requests between
+ * them so the device sees several requests at once.
+ *
+ * With the meta option, metadata (everything that goes through tfs_bread()/tfs_bwrite(), plus the superblock
+ * and the checksum area) is read and written with dev_mread()/dev_mwrite() in a file of its own, at the same
+ * offsets it would have in DISKFILE. File data stays in DISKFILE (and the stripes), so lookups never wait
+ * behind bulk data I/O. Both files are sparse, so each one only takes up space for its own blocks.
+ */
+
+/*
+ * Which backing file holds block_num, and where in it. Returns the descriptor.
+ */
+static int dev_map(struct tfs_fs* fs, int block_num, off_t* pos) {
+	if(fs->nstripes <= 1){
+		*pos = (off_t)block_num * BLOCK_SIZE;
+		return fs->dev_fd;
+	}
+	int unit = block_num / fs->stripe_unit;
+	*pos = ((off_t)(unit / fs->nstripes) * fs->stripe_unit + block_num % fs->stripe_unit) * BLOCK_SIZE;
+	return fs->stripes[unit % fs->nstripes].fd;
+}
+
+static int dev_stripe(struct tfs_fs* fs, int block_num) {
+	return (fs->nstripes <= 1) ? 0 : (block_num / fs->stripe_unit) % fs->nstripes;
+}
+
+/*
+ * Size of each backing file: its share of the stripe units, rounded up.
+ */
+static off_t dev_file_size(struct tfs_fs* fs) {
+	if(fs->nstripes <= 1){
+		return DISK_SIZE;
+	}
+	int units = (TFS_NBLOCKS + fs->stripe_unit - 1) / fs->stripe_unit;
+	return (off_t)((units + fs->nstripes - 1) / fs->nstripes) * fs->stripe_unit * BLOCK_SIZE;
+}
+
+/*
+ * Split the stripes option ("/disk2/DISKFILE:/disk3/DISKFILE") into fs->stripes, with DISKFILE as the first.
+ * Returns -EINVAL for too many files and -ENAMETOOLONG for a path that doesn't fit.
+ */
+static int stripe_setup(struct tfs_fs* fs) {
+	if(fs->opts.stripes == NULL || fs->opts.stripes[0] == '\0'){
+		return 0;
+	}
+	fs->stripes = (struct tfs_stripe*)calloc(TFS_MAX_STRIPES, sizeof(struct tfs_stripe));
+	memcpy(fs->stripes[0].path, fs->diskfile_path, strlen(fs->diskfile_path) + 1);	// libtfs_mount() checked its length
+	fs->nstripes = 1;
+	const char* start = fs->opts.stripes;
+	while(*start != '\0'){
+		const char* end = strchr(start, ':');
+		int len = (end != NULL) ? end - start : (int)strlen(start);
+		if(len > 0){
+			if(fs->nstripes == TFS_MAX_STRIPES){
+				return -EINVAL;
+			}
+			if(len >= PATH_MAX){
+				return -ENAMETOOLONG;
+			}
+			memcpy(fs->stripes[fs->nstripes].path, start, len);
+			fs->nstripes++;
+		}
+		start += (end != NULL) ? len + 1 : len;
+	}
+	fs->stripe_unit = (fs->opts.stripe_unit > 0) ? fs->opts.stripe_unit : TFS_STRIPE_UNIT;
+	return 0;
+}
+
+/*
+ * Create the disk file, DISK_SIZE bytes of zeroes (what dev_init() in block.c does). ftruncate() leaves it
+ * all one hole, so a block only takes up space on the host once it's written. Striped images create every
+ * backing file with its share of the blocks.
+ */
+static int dev_create(struct tfs_fs* fs) {
+	int count = (fs->nstripes > 1) ? fs->nstripes : 1;
+	int i = 0;
+	for(i = 0; i < count; i++){
+		int fd = open((fs->nstripes > 1) ? fs->stripes[i].path : fs->diskfile_path, O_RDWR | O_CREAT, 0644);
+		if(fd == -1){
+			return -1;
+		}
+		int ret = ftruncate(fd, dev_file_size(fs));
+		close(fd);
+		if(ret == -1){
+			return -1;
+		}
+	}
+	if(fs->opts.meta != NULL){
+		int fd = open(fs->opts.meta, O_RDWR | O_CREAT, 0644);
+		if(fd == -1){
+			return -1;
+		}
+		int ret = ftruncate(fd, DISK_SIZE);
+		close(fd);
+		if(ret == -1){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int dev_open_file(struct tfs_fs* fs, const char* path) {
+	if(fs->opts.direct_io){
+		int fd = open(path, O_RDWR | O_DIRECT);
+		if(fd != -1 || errno == ENOENT){
+			return fd;
+		}
+		// tmpfs and a few others don't do O_DIRECT, that's not worth failing the mount over.
+		fprintf(stderr, "tfs: can't open %s with O_DIRECT (%s), using buffered I/O\n", path, strerror(errno));
+		fs->opts.direct_io = 0;
+	}
+	return open(path, O_RDWR);
+}
+
+/*
+ * Worker thread of one backing file: runs whatever dev_rw_many() hands it, one job at a time.
+ */
+static void stripe_run(struct tfs_fs* fs, int stripe, const struct stripe_job* job);
+
+static void* stripe_worker(void* arg) {
+	struct tfs_stripe* self = (struct tfs_stripe*)arg;
+	pthread_mutex_lock(&self->lock);
+	while(1){
+		while(self->job == NULL && !self->quit){
+			pthread_cond_wait(&self->cond, &self->lock);
+		}
+		if(self->quit){
+			break;
+		}
+		const struct stripe_job* job = self->job;
+		pthread_mutex_unlock(&self->lock);
+		stripe_run(job->fs, self - job->fs->stripes, job);
+		pthread_mutex_lock(&self->lock);
+		self->job = NULL;
+		pthread_cond_broadcast(&self->cond);
+	}
+	pthread_mutex_unlock(&self->lock);
+	return NULL;
+}
+
+/*
+ * Open our descriptor(s) on the disk file(s), they have to exist already.
+ */
+static int dev_attach(struct tfs_fs* fs) {
+	if(fs->dev_fd != -1){
+		return 0;
+	}
+	if(fs->opts.meta != NULL){
+		fs->meta_fd = dev_open_file(fs, fs->opts.meta);
+		if(fs->meta_fd == -1){
+			return -1;
+		}
+	}
+	int i = 0;
+	if(fs->nstripes <= 1){
+		fs->dev_fd = dev_open_file(fs, fs->diskfile_path);
+		if(fs->dev_fd == -1){
+			if(fs->meta_fd != -1){
+				close(fs->meta_fd);
+				fs->meta_fd = -1;
+			}
+			return -1;
+		}
+		if(fs->stripes == NULL){
+			fs->stripes = (struct tfs_stripe*)calloc(TFS_IO_WORKERS, sizeof(struct tfs_stripe));
+		}
+		fs->nworkers = TFS_IO_WORKERS;
+		for(i = 0; i < fs->nworkers; i++){
+			fs->stripes[i].fd = fs->dev_fd;
+		}
+	}
+	else{
+		for(i = 0; i < fs->nstripes; i++){
+			fs->stripes[i].fd = dev_open_file(fs, fs->stripes[i].path);
+			if(fs->stripes[i].fd == -1){
+				while(--i >= 0){
+					close(fs->stripes[i].fd);
+				}
+				if(fs->meta_fd != -1){
+					close(fs->meta_fd);
+					fs->meta_fd = -1;
+				}
+				return -1;
+			}
+		}
+		fs->dev_fd = fs->stripes[0].fd;
+		fs->nworkers = fs->nstripes;
+	}
+	for(i = 0; i < fs->nworkers; i++){
+		pthread_mutex_init(&fs->stripes[i].lock, NULL);
+		pthread_cond_init(&fs->stripes[i].cond, NULL);
+		fs->stripes[i].job = NULL;
+		fs->stripes[i].quit = 0;
+		pthread_create(&fs->stripes[i].worker, NULL, stripe_worker, &fs->stripes[i]);
+	}
+	return 0;
+}
+
+static void dev_detach(struct tfs_fs* fs) {
+	if(fs->dev_fd == -1){
+		return;
+	}
+	int i = 0;
+	for(i = 0; i < fs->nworkers; i++){
+		pthread_mutex_lock(&fs->stripes[i].lock);
+		fs->stripes[i].quit = 1;
+		pthread_cond_broadcast(&fs->stripes[i].cond);
+		pthread_mutex_unlock(&fs->stripes[i].lock);
+		pthread_join(fs->stripes[i].worker, NULL);
+		pthread_mutex_destroy(&fs->stripes[i].lock);
+		pthread_cond_destroy(&fs->stripes[i].cond);
+		if(fs->nstripes > 1){
+			close(fs->stripes[i].fd);
+		}
+	}
+	fs->nworkers = 0;
+	if(fs->nstripes <= 1){
+		close(fs->dev_fd);
+	}
+	if(fs->meta_fd != -1){
+		close(fs->meta_fd);
+		fs->meta_fd = -1;
+	}
+	fs->dev_fd = -1;
+}
+
+/*
+ * Give nblks blocks starting at block_num back to the host file system. They read back as zeroes afterwards.
+ * Turns the sparse option off if the host can't punch holes.
+ */
+static int dev_discard(struct tfs_fs* fs, int block_num, int nblks) {
+	if(fs->fault != NULL && fs->fault->crashed){
+		return 0;					// the disk is gone as far as the test is concerned
+	}
+	while(nblks > 0){
+		// A piece can't cross into the next stripe unit, that lives in another file.
+		int piece = (fs->nstripes > 1) ? fs->stripe_unit - block_num % fs->stripe_unit : nblks;
+		if(piece > nblks){
+			piece = nblks;
+		}
+		off_t pos = 0;
+		int fd = dev_map(fs, block_num, &pos);
+		if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, (off_t)piece * BLOCK_SIZE) == -1){
+			if(errno == EOPNOTSUPP){
+				fprintf(stderr, "tfs: %s can't punch holes, freed blocks stay allocated on the host\n", fs->diskfile_path);
+				fs->opts.sparse = 0;
+			}
+			return -1;
+		}
+		// The block may have been a directory block, which lives in the metadata file.
+		if(fs->meta_fd != -1){
+			fallocate(fs->meta_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)block_num * BLOCK_SIZE, (off_t)piece * BLOCK_SIZE);
+		}
+		fs->stats.discard_calls++;
+		fs->stats.discarded_blocks += piece;
+		block_num += piece;
+		nblks -= piece;
+	}
+	return 0;
+}
+
+/*
+ * The crash: each remembered write is kept or taken back at random, and every block they touched ends up
+ * with the newest write that was kept, or with what it held before all of them. Called with f->lock held.
+ */
+static void fault_crash(struct tfs_fault_state* f) {
+	char keep[TFS_FAULT_REORDER];
+	int ring = f->conf.reorder;				// only undo[0..ring) have buffers
+	int first = (ring > 0) ? (f->undo_next - f->undo_count + ring) % ring : 0;
+	int i = 0;
+	for(i = 0; i < f->undo_count; i++){
+		keep[i] = rand_r(&f->seed) & 1;
+	}
+	for(i = 0; i < f->undo_count; i++){
+		struct fault_undo* u = &f->undo[(first + i) % ring];
+		int seen = 0;
+		int j = 0;
+		for(j = 0; j < i && !seen; j++){
+			struct fault_undo* v = &f->undo[(first + j) % ring];
+			seen = (v->fd == u->fd && v->pos == u->pos);
+		}
+		if(seen){
+			continue;				// already settled by its oldest write
+		}
+		const char* data = u->old_data;
+		for(j = i; j < f->undo_count; j++){
+			struct fault_undo* v = &f->undo[(first + j) % ring];
+			if(v->fd == u->fd && v->pos == u->pos && keep[j]){
+				data = v->new_data;
+			}
+		}
+		if(pwrite(u->fd, data, BLOCK_SIZE, u->pos) != BLOCK_SIZE){
+			fprintf(stderr, "tfs: fault injection couldn't put a reordered block back\n");
+		}
+	}
+	f->undo_count = 0;
+	f->crashed = 1;
+}
+
+/*
+ * pwrite() with the faults libtfs_set_fault() asked for. A dropped write still reports success, the way
+ * a disk that loses power with the write in its cache would. io_buf is aligned for O_DIRECT.
+ */
+static ssize_t fault_pwrite(struct tfs_fs* fs, int fd, const void* io_buf, off_t pos) {
+	struct tfs_fault_state* f = fs->fault;
+	ssize_t ret = BLOCK_SIZE;
+	pthread_mutex_lock(&f->lock);
+	if(!f->crashed && f->conf.crash_after >= 0 && f->written >= f->conf.crash_after){
+		fault_crash(f);
+	}
+	if(f->crashed || (f->conf.drop_ppm > 0 && (unsigned)(rand_r(&f->seed) % 1000000) < f->conf.drop_ppm)){
+		fs->stats.dev_writes_dropped++;
+	}
+	else{
+		if(f->conf.reorder > 0){
+			struct fault_undo* u = &f->undo[f->undo_next];
+			u->fd = fd;
+			u->pos = pos;
+			if(pread(fd, u->old_data, BLOCK_SIZE, pos) != BLOCK_SIZE){
+				memset(u->old_data, 0, BLOCK_SIZE);		// past the end of the file, that's a hole
+			}
+			memcpy(u->new_data, io_buf, BLOCK_SIZE);
+			f->undo_next = (f->undo_next + 1) % f->conf.reorder;
+			if(f->undo_count < f->conf.reorder){
+				f->undo_count++;
+			}
+		}
+		ret = pwrite(fd, io_buf, BLOCK_SIZE, pos);
+		f->written++;
+	}
+	pthread_mutex_unlock(&f->lock);
+	return ret;
+}
+
+static int dev_pread(struct tfs_fs* fs, int fd, off_t pos, void* buf) {
+	// O_DIRECT needs an aligned buffer, bounce through the pool for the odd caller that doesn't have one.
+	void* io_buf = (!fs->opts.direct_io || (uintptr_t)buf % BLOCK_SIZE == 0) ? buf : blkbuf_get();
+	ssize_t ret = pread(fd, io_buf, BLOCK_SIZE, pos);
+	__sync_fetch_and_add(&fs->stats.dev_reads, 1);		// the I/O workers get here in parallel
+	if(io_buf != buf){
+		memcpy(buf, io_buf, BLOCK_SIZE);
+		blkbuf_put(io_buf);
+	}
+	return (ret == BLOCK_SIZE) ? BLOCK_SIZE : -1;
+}
+
+static int dev_pwrite(struct tfs_fs* fs, int fd, off_t pos, const void* buf) {
+	const void* io_buf = buf;
+	void* bounce = NULL;
+	if(fs->opts.direct_io && (uintptr_t)buf % BLOCK_SIZE != 0){
+		bounce = blkbuf_get();
+		memcpy(bounce, buf, BLOCK_SIZE);
+		io_buf = bounce;
+	}
+	ssize_t ret = (fs->fault != NULL) ? fault_pwrite(fs, fd, io_buf, pos) : pwrite(fd, io_buf, BLOCK_SIZE, pos);
+	__sync_fetch_and_add(&fs->stats.dev_writes, 1);
+	blkbuf_put(bounce);
+	return (ret == BLOCK_SIZE) ? BLOCK_SIZE : -1;
+}
+
+static int dev_read(struct tfs_fs* fs, int block_num, void* buf) {
+	off_t pos = 0;
+	int fd = dev_map(fs, block_num, &pos);
+	return dev_pread(fs, fd, pos, buf);
+}
+
+static int dev_write(struct tfs_fs* fs, int block_num, const void* buf) {
+	off_t pos = 0;
+	int fd = dev_map(fs, block_num, &pos);
+	return dev_pwrite(fs, fd, pos, buf);
+}
+
+/*
+ * Write barrier: every block written before it is on stable storage before any block written after it.
+ * Only the commit_sync option pays for a real one (fdatasync() of every backing file). Without it the host's
+ * page cache still keeps our writes in order when tfs itself dies, just not when the power goes.
+ */
+static int dev_flush(struct tfs_fs* fs) {
+	if(!fs->opts.commit_sync){
+		return 0;
+	}
+	if(fs->fault != NULL){
+		pthread_mutex_lock(&fs->fault->lock);
+		if(!fs->fault->crashed){
+			fs->fault->undo_count = 0;		// a crash can't take these back anymore
+		}
+		pthread_mutex_unlock(&fs->fault->lock);
+	}
+	int ret = 0;
+	int i = 0;
+	for(i = 0; i < ((fs->nstripes > 1) ? fs->nstripes : 1); i++){
+		if(fdatasync((fs->nstripes > 1) ? fs->stripes[i].fd : fs->dev_fd) == -1){
+			ret = -1;
+		}
+	}
+	if(fs->meta_fd != -1 && fdatasync(fs->meta_fd) == -1){
+		ret = -1;
+	}
+	fs->stats.dev_flushes++;
+	return ret;
+}
+
+/*
+ * Same for a metadata block, which is in the metadata file if there is one. These go to the disk right away,
+ * dev_mread()/dev_mwrite() below go through the journal.
+ */
+static int dev_mread_home(struct tfs_fs* fs, int block_num, void* buf) {
+	if(fs->meta_fd == -1){
+		return dev_read(fs, block_num, buf);
+	}
+	return dev_pread(fs, fs->meta_fd, (off_t)block_num * BLOCK_SIZE, buf);
+}
+
+static int dev_mwrite_home(struct tfs_fs* fs, int block_num, const void* buf) {
+	if(fs->meta_fd == -1){
+		return dev_write(fs, block_num, buf);
+	}
+	return dev_pwrite(fs, fs->meta_fd, (off_t)block_num * BLOCK_SIZE, buf);
+}
+
+/*
+ * Journal
+ */
+static int journal_find(struct tfs_journal* j, int block_num) {
+	int i = 0;
+	for(i = 0; i < j->count; i++){
+		if(j->blks[i] == block_num){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Write the blocks collected so far to the journal area, then to where they belong. Called with fs->lock held,
+ * normally by tfs_unlock(), earlier if a call changes more blocks than the journal holds.
+ */
+static int journal_commit(struct tfs_fs* fs) {
+	struct tfs_journal* j = fs->jnl;
+	if(j == NULL || j->count == 0){
+		return 0;
+	}
+
+	// Step 1: The last commit's home writes and this call's file data go first, the journal area is about to be reused
+	dev_flush(fs);
+
+	// Step 2: The logged blocks, then the header that makes them count
+	struct journal_hdr* hdr = (struct journal_hdr*)blkbuf_get();
+	memset(hdr, 0, BLOCK_SIZE);
+	hdr->magic = JOURNAL_MAGIC;
+	hdr->count = j->count;
+	hdr->seq = ++j->seq;
+	int logged = 1;
+	int i = 0;
+	for(i = 0; i < j->count; i++){
+		hdr->blks[i] = j->blks[i];
+		hdr->csums[i] = block_csum(j->bufs[i]);
+		if(dev_mwrite_home(fs, fs->sb_ext.journal_start_blk + 1 + i, j->bufs[i]) < 0){
+			logged = 0;
+		}
+	}
+	hdr->csum = block_csum(hdr);
+	if(!logged || dev_mwrite_home(fs, fs->sb_ext.journal_start_blk, hdr) < 0){
+		logged = 0;				// not atomic this time, but the blocks still have to get home
+	}
+	blkbuf_put(hdr);
+	dev_flush(fs);
+
+	// Step 3: Home writes. A crash from here on is repaired by the next mount's replay.
+	int ret = 0;
+	for(i = 0; i < j->count; i++){
+		if(dev_mwrite_home(fs, j->blks[i], j->bufs[i]) < 0){
+			ret = -EIO;
+		}
+	}
+	fs->stats.journal_commits += logged;
+	fs->stats.journal_blocks += j->count;
+	j->count = 0;
+	return ret;
+}
+
+/*
+ * Metadata block I/O, through the journal when the image has one.
+ */
+static int dev_mread(struct tfs_fs* fs, int block_num, void* buf) {
+	int i = (fs->jnl != NULL) ? journal_find(fs->jnl, block_num) : -1;
+	if(i >= 0){
+		memcpy(buf, fs->jnl->bufs[i], BLOCK_SIZE);	// written by this call, not on disk yet
+		return BLOCK_SIZE;
+	}
+	return dev_mread_home(fs, block_num, buf);
+}
+
+static int dev_mwrite(struct tfs_fs* fs, int block_num, const void* buf) {
+	struct tfs_journal* j = fs->jnl;
+	if(j == NULL){
+		return dev_mwrite_home(fs, block_num, buf);
+	}
+	int i = journal_find(j, block_num);
+	if(i < 0){
+		if(j->count == JOURNAL_MAX && journal_commit(fs) < 0){
+			return -1;
+		}
+		i = j->count;
+		if(j->bufs[i] == NULL){
+			j->bufs[i] = (char*)blkbuf_alloc(BLOCK_SIZE);
+			if(j->bufs[i] == NULL){
+				return -1;
+			}
+		}
+		j->blks[i] = block_num;
+		j->count++;
+	}
+	memcpy(j->bufs[i], buf, BLOCK_SIZE);
+	return BLOCK_SIZE;
+}
+
+/*
+ * A block freed by this call: whatever it was going to be written with doesn't matter anymore, and it mustn't
+ * land on top of file data if the block is handed out again before the commit.
+ */
+static void journal_forget(struct tfs_fs* fs, int block_num) {
+	struct tfs_journal* j = fs->jnl;
+	int i = (j != NULL) ? journal_find(j, block_num) : -1;
+	if(i < 0){
+		return;
+	}
+	j->count--;
+	char* buf = j->bufs[i];
+	j->blks[i] = j->blks[j->count];		// the last one takes its slot, the order doesn't matter
+	j->bufs[i] = j->bufs[j->count];
+	j->bufs[j->count] = buf;
+}
+
+/*
+ * Put the last commit in place again, if it made it to the journal area whole (called from libtfs_mount(),
+ * before anything else reads metadata). Writing it twice does no harm. Returns the number of blocks replayed.
+ */
+static int journal_replay(struct tfs_fs* fs) {
+	struct journal_hdr* hdr = (struct journal_hdr*)blkbuf_get();
+	char* buf = (char*)blkbuf_get();
+	int replayed = 0;
+	if(dev_mread_home(fs, fs->sb_ext.journal_start_blk, hdr) < 0 || hdr->magic != JOURNAL_MAGIC || hdr->count > JOURNAL_MAX){
+		goto out;
+	}
+	uint32_t csum = hdr->csum;
+	hdr->csum = 0;
+	if(block_csum(hdr) != csum){
+		goto out;
+	}
+
+	// Step 1: Every logged block has to be the one the header describes, or the commit never finished
+	int i = 0;
+	for(i = 0; i < (int)hdr->count; i++){
+		if(hdr->blks[i] >= TFS_NBLOCKS || (hdr->blks[i] >= fs->sb_ext.journal_start_blk &&
+		   hdr->blks[i] < fs->sb_ext.journal_start_blk + fs->sb_ext.journal_nblks)){
+			goto out;
+		}
+		if(dev_mread_home(fs, fs->sb_ext.journal_start_blk + 1 + i, buf) < 0 || block_csum(buf) != hdr->csums[i]){
+			goto out;
+		}
+	}
+
+	// Step 2: Copy them home
+	for(i = 0; i < (int)hdr->count; i++){
+		if(dev_mread_home(fs, fs->sb_ext.journal_start_blk + 1 + i, buf) < 0 || dev_mwrite_home(fs, hdr->blks[i], buf) < 0){
+			fprintf(stderr, "tfs: couldn't replay block %u from the journal\n", hdr->blks[i]);
+			continue;
+		}
+		replayed++;
+	}
+	dev_flush(fs);
+out:
+	blkbuf_put(buf);
+	blkbuf_put(hdr);
+	return replayed;
+}
+
+/*
+ * Start collecting metadata writes, once the image is set up (it's NULL while tfs_mkfs() writes it out).
+ */
+static int journal_start(struct tfs_fs* fs) {
+	if(!(fs->sb_ext.features & TFS_FEAT_JOURNAL) || fs->jnl != NULL){
+		return 0;
+	}
+	fs->jnl = (struct tfs_journal*)calloc(1, sizeof(struct tfs_journal));
+	return (fs->jnl == NULL) ? -1 : 0;
+}
+
+/*
+ * Unmount: everything is home, so the journal area can't be replayed over anything newer later on.
+ */
+static void journal_stop(struct tfs_fs* fs) {
+	struct tfs_journal* j = fs->jnl;
+	if(j == NULL){
+		return;
+	}
+	journal_commit(fs);
+	fs->jnl = NULL;
+	dev_flush(fs);
+	char* zero = (char*)blkbuf_zalloc(BLOCK_SIZE);
+	dev_mwrite_home(fs, fs->sb_ext.journal_start_blk, zero);
+	free(zero);
+	int i = 0;
+	for(i = 0; i < JOURNAL_MAX; i++){
+		free(j->bufs[i]);
+	}
+	free(j);
+}
+
+/*
+ * Which worker gets block #i of a job: the one of its backing file, or else an even, contiguous share each.
+ */
+static int job_worker(struct tfs_fs* fs, const struct stripe_job* job, int i) {
+	if(fs->nstripes > 1){
+		return dev_stripe(fs, job->blks[i]);
+	}
+	return i * fs->nworkers / job->count;
+}
+
+/*
+ * The part of a dev_rw_many() job that belongs to one worker (-1 for all of it).
+ */
+static void stripe_run(struct tfs_fs* fs, int worker, const struct stripe_job* job) {
+	int i = 0;
+	for(i = 0; i < job->count; i++){
+		if(worker != -1 && job_worker(fs, job, i) != worker){
+			continue;
+		}
+		int ret = job->write ? dev_write(fs, job->blks[i], job->bufs[i]) : dev_read(fs, job->blks[i], job->bufs[i]);
+		job->failed[i] = (ret < 0);
+	}
+}
+
+/*
+ * Read or write count blocks at once. Every worker's share (a backing file's blocks on a striped image, an even
+ * split otherwise) is transferred at the same time. failed[i] is set for each block that didn't make it.
+ */
+static void dev_rw_many(struct tfs_fs* fs, int write, const int* blks, char* const* bufs, char* failed, int count) {
+	struct stripe_job job = { fs, write, blks, bufs, failed, count };
+	if(fs->nworkers == 0 || count < 2){
+		stripe_run(fs, -1, &job);
+		return;
+	}
+
+	// Step 1: Hand every worker with something to do (except the first one) its share
+	char busy[TFS_MAX_STRIPES];
+	memset(busy, 0, sizeof(busy));
+	int i = 0;
+	for(i = 0; i < count; i++){
+		busy[job_worker(fs, &job, i)] = 1;
+	}
+	int mine = -1;
+	for(i = 0; i < fs->nworkers; i++){
+		if(!busy[i]){
+			continue;
+		}
+		if(mine == -1){
+			mine = i;				// this one we do ourselves
+			continue;
+		}
+		pthread_mutex_lock(&fs->stripes[i].lock);
+		while(fs->stripes[i].job != NULL){
+			pthread_cond_wait(&fs->stripes[i].cond, &fs->stripes[i].lock);	// another thread's job is still running
+		}
+		fs->stripes[i].job = &job;
+		pthread_cond_broadcast(&fs->stripes[i].cond);
+		pthread_mutex_unlock(&fs->stripes[i].lock);
+	}
+
+	// Step 2: Do our share, then wait for the others
+	stripe_run(fs, mine, &job);
+	for(i = mine + 1; i < fs->nworkers; i++){
+		if(!busy[i]){
+			continue;
+		}
+		pthread_mutex_lock(&fs->stripes[i].lock);
+		while(fs->stripes[i].job == &job){
+			pthread_cond_wait(&fs->stripes[i].cond, &fs->stripes[i].lock);
+		}
+		pthread_mutex_unlock(&fs->stripes[i].lock);
+	}
+}
+
+/*
+ * Block I/O with checksums
+ */
+static int csum_covers(struct tfs_fs* fs, int block_num) {
+	// The superblock is read before the table is loaded, and the checksum area can't checksum itself.
+	return fs->csum_table != NULL && block_num > 0 && block_num < (int)fs->sb_ext.csum_start_blk;
+}
+
+static int csum_verify(struct tfs_fs* fs, int block_num, const void* buf) {
+	uint32_t expected = fs->csum_table[block_num];
+	if(expected == 0){
+		return 0;			// never written through tfs_bwrite()/tfs_dwrite(), nothing to compare against
+	}
+	fs->stats.csum_verified++;
+	if(block_csum(buf) != expected){
+		fs->stats.csum_errors++;
+		fprintf(stderr, "tfs: checksum mismatch on block %d\n", block_num);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int csum_store(struct tfs_fs* fs, int block_num, uint32_t csum) {
+	if(fs->csum_table[block_num] == csum){
+		return 0;			// the checksum block on disk is already right, skip the write
+	}
+	fs->csum_table[block_num] = csum;
+	int csum_blk = block_num / CSUM_PER_BLK;
+	return dev_mwrite(fs, fs->sb_ext.csum_start_blk + csum_blk, fs->csum_table + csum_blk * CSUM_PER_BLK);
+}
+
+/*
+ * Read/write a metadata block: superblock, bitmaps, inode table and directory blocks.
+ */
+static int tfs_bread(struct tfs_fs* fs, int block_num, void* buf) {
+	int ret = dev_mread(fs, block_num, buf);
+	if(ret < 0){
+		return ret;
+	}
+	if(csum_covers(fs, block_num)){
+		return csum_verify(fs, block_num, buf);
+	}
+	return 0;
+}
+
+static int tfs_bwrite(struct tfs_fs* fs, int block_num, const void* buf) {
+	int ret = dev_mwrite(fs, block_num, buf);
+	if(ret < 0){
+		return ret;
+	}
+	if(csum_covers(fs, block_num)){
+		return csum_store(fs, block_num, block_csum(buf));
+	}
+	return 0;
+}
+
+/*
+ * Read/write a regular file data block. These are only checksummed with the csum_data mount option.
+ */
+static int tfs_dread(struct tfs_fs* fs, int block_num, void* buf) {
+	int ret = dev_read(fs, block_num, buf);
+	if(ret < 0){
+		return ret;
+	}
+	if(fs->opts.csum_data && csum_covers(fs, block_num)){
+		return csum_verify(fs, block_num, buf);
+	}
+	return 0;
+}
+
+static int tfs_dwrite(struct tfs_fs* fs, int block_num, const void* buf) {
+	int ret = dev_write(fs, block_num, buf);
+	if(ret < 0){
+		return ret;
+	}
+	if(csum_covers(fs, block_num)){
+		// Without csum_data, drop any old checksum so a later csum_data mount doesn't trip over it.
+		return csum_store(fs, block_num, fs->opts.csum_data ? block_csum(buf) : 0);
+	}
+	return 0;
+}
+
+/*
+ * tfs_dread()/tfs_dwrite() for up to 16 data blocks at once, through dev_rw_many(). Both return how many
+ * blocks from the start of the list made it, so count means all of them.
+ */
+static int tfs_dread_many(struct tfs_fs* fs, const int* blks, char* const* bufs, int count) {
+	char failed[16];
+	dev_rw_many(fs, 0, blks, bufs, failed, count);
+	int i = 0;
+	for(i = 0; i < count; i++){
+		if(failed[i] || (fs->opts.csum_data && csum_covers(fs, blks[i]) && csum_verify(fs, blks[i], bufs[i]) < 0)){
+			break;
+		}
+	}
+	return i;
+}
+
+static int tfs_dwrite_many(struct tfs_fs* fs, const int* blks, char* const* bufs, int count) {
+	char failed[16];
+	dev_rw_many(fs, 1, blks, bufs, failed, count);
+	int done = 0;
+	while(done < count && !failed[done]){
+		done++;
+	}
+
+	// Same checksum update as tfs_dwrite(), but each checksum block only goes to disk once.
+	int dirty[16];
+	int ndirty = 0;
+	int i = 0;
+	for(i = 0; i < done; i++){
+		if(!csum_covers(fs, blks[i])){
+			continue;
+		}
+		uint32_t csum = fs->opts.csum_data ? block_csum(bufs[i]) : 0;
+		if(fs->csum_table[blks[i]] == csum){
+			continue;
+		}
+		fs->csum_table[blks[i]] = csum;
+		int csum_blk = blks[i] / CSUM_PER_BLK;
+		int j = 0;
+		while(j < ndirty && dirty[j] != csum_blk){
+			j++;
+		}
+		if(j == ndirty){
+			dirty[ndirty++] = csum_blk;
+		}
+	}
+	for(i = 0; i < ndirty; i++){
+		if(dev_mwrite(fs, fs->sb_ext.csum_start_blk + dirty[i], fs->csum_table + dirty[i] * CSUM_PER_BLK) < 0){
+			return 0;
+		}
+	}
+	return done;
+}
+
+/*
+ * Load the checksum area into memory (called from libtfs_mount(), after the superblock is read).
+ */
+static int csum_load(struct tfs_fs* fs) {
+	fs->csum_table = (uint32_t*)blkbuf_zalloc(fs->sb_ext.csum_nblks * BLOCK_SIZE);
+	int count = 0;
+	for(count = 0; count < (int)fs->sb_ext.csum_nblks; count++){
+		if(dev_mread(fs, fs->sb_ext.csum_start_blk + count, fs->csum_table + count * CSUM_PER_BLK) < 0){
+			free(fs->csum_table);
+			fs->csum_table = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Reference counts for shared data blocks. fs->ref_table[blk] counts the owners a block has *besides* the first,
+ * so 0 means "owned by one file" and images without the area behave exactly like before.
+ */
+#define REF_MAX			255
+
+static int ref_load(struct tfs_fs* fs) {
+	fs->ref_table = (uint8_t*)blkbuf_zalloc(fs->sb_ext.ref_nblks * BLOCK_SIZE);
+	int count = 0;
+	for(count = 0; count < (int)fs->sb_ext.ref_nblks; count++){
+		if(tfs_bread(fs, fs->sb_ext.ref_start_blk + count, fs->ref_table + count * BLOCK_SIZE) < 0){
+			free(fs->ref_table);
+			fs->ref_table = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int blk_shared(struct tfs_fs* fs, int block_num) {
+	return fs->ref_table != NULL && fs->ref_table[block_num] > 0;
+}
+
+/*
+ * Can't a data block be overwritten in place? Not if it's shared with a clone, and not with csum_data either:
+ * its new checksum only goes to disk with the journal commit, so until then the old data has to stay where it is.
+ */
+static int blk_cow(struct tfs_fs* fs, int block_num) {
+	return blk_shared(fs, block_num) || (fs->opts.csum_data && csum_covers(fs, block_num));
+}
+
+/*
+ * Write back the reference count blocks that cover the given data blocks, each one only once.
+ */
+static int ref_flush(struct tfs_fs* fs, const int* blks, int count) {
+	char* dirty = (char*)calloc(fs->sb_ext.ref_nblks, 1);
+	int i = 0;
+	for(i = 0; i < count; i++){
+		dirty[blks[i] / BLOCK_SIZE] = 1;
+	}
+	int ret = 0;
+	for(i = 0; i < (int)fs->sb_ext.ref_nblks; i++){
+		if(dirty[i] && tfs_bwrite(fs, fs->sb_ext.ref_start_blk + i, fs->ref_table + i * BLOCK_SIZE) < 0){
+			ret = -EIO;
+		}
+	}
+	free(dirty);
+	return ret;
+}
+
+/*
+ * Write the extended superblock back into block #0 (the state bits change while mounted).
+ */
+static int sb_ext_store(struct tfs_fs* fs) {
+	char* block = (char*)blkbuf_get();
+	int ret = dev_mread(fs, 0, block);
+	if(ret >= 0){
+		memcpy(block + sizeof(struct superblock), &fs->sb_ext, sizeof(struct superblock_ext));
+		ret = dev_mwrite(fs, 0, block);
+	}
+	blkbuf_put(block);
+	return (ret < 0) ? -EIO : 0;
+}
+
+/*
+ * Block deduplication
+ */
+#define XXH_P1		0x9E3779B185EBCA87ULL
+#define XXH_P2		0xC2B2AE3D27D4EB4FULL
+#define XXH_P3		0x165667B19E3779F9ULL
+#define XXH_P4		0x85EBCA77C2B2AE63ULL
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+	acc += input * XXH_P2;
+	acc = (acc << 31) | (acc >> 33);
+	return acc * XXH_P1;
+}
+
+/*
+ * 64-bit content hash of a block (the XXH64 construction). Four independent accumulators walk 32-byte
+ * stripes, so the multiplies pipeline and the compiler can vectorize the loop. Hits are always compared
+ * byte for byte before a block is shared, so the hash only has to be fast and well spread.
+ */
+static uint64_t dedup_hash(const void* buf) {
+	const unsigned char* p = (const unsigned char*)buf;
+	uint64_t acc[4] = { XXH_P1 + XXH_P2, XXH_P2, 0, 0 - XXH_P1 };
+	int stripe = 0;
+	for(stripe = 0; stripe < BLOCK_SIZE; stripe += 32){
+		uint64_t words[4];
+		memcpy(words, p + stripe, 32);
+		int lane = 0;
+		for(lane = 0; lane < 4; lane++){
+			acc[lane] = xxh_round(acc[lane], words[lane]);
+		}
+	}
+	uint64_t h = ((acc[0] << 1) | (acc[0] >> 63)) + ((acc[1] << 7) | (acc[1] >> 57)) +
+		     ((acc[2] << 12) | (acc[2] >> 52)) + ((acc[3] << 18) | (acc[3] >> 46));
+	int lane = 0;
+	for(lane = 0; lane < 4; lane++){
+		h ^= xxh_round(0, acc[lane]);
+		h = h * XXH_P1 + XXH_P4;
+	}
+	h += BLOCK_SIZE;
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * Load the dedup index. If we crashed while it was dirty it can't be trusted (it might point at blocks
+ * that were freed since), so we start over with an empty one.
+ */
+static void dedup_alloc(struct tfs_fs* fs) {
+	fs->dedup_table = (struct dedup_entry*)blkbuf_zalloc(fs->sb_ext.dedup_nblks * BLOCK_SIZE);
+	fs->dedup_slot_of = (uint16_t*)malloc(TFS_NBLOCKS * sizeof(uint16_t));
+	fs->dedup_dirty = (char*)calloc(fs->sb_ext.dedup_nblks, 1);
+	memset(fs->dedup_slot_of, 0xFF, TFS_NBLOCKS * sizeof(uint16_t));
+}
+
+static int dedup_load(struct tfs_fs* fs) {
+	dedup_alloc(fs);
+	if(fs->sb_ext.state & TFS_STATE_DEDUP_DIRTY){
+		fprintf(stderr, "tfs: dedup index wasn't written back last time, starting with an empty one\n");
+		memset(fs->dedup_dirty, 1, fs->sb_ext.dedup_nblks);
+		return 0;
+	}
+
+	int count = 0;
+	for(count = 0; count < (int)fs->sb_ext.dedup_nblks; count++){
+		if(tfs_bread(fs, fs->sb_ext.dedup_start_blk + count, (char*)fs->dedup_table + count * BLOCK_SIZE) < 0){
+			memset(fs->dedup_table, 0, fs->sb_ext.dedup_nblks * BLOCK_SIZE);	// same as a crash, just forget everything
+			memset(fs->dedup_dirty, 1, fs->sb_ext.dedup_nblks);
+			return 0;
+		}
+	}
+	int slot = 0;
+	for(slot = 0; slot < (int)DEDUP_SLOTS; slot++){
+		uint32_t blk = fs->dedup_table[slot].blk;
+		if(blk >= fs->sb_ext.d_end_blk){
+			fs->dedup_table[slot].blk = 0;		// garbage, ignore it
+		}
+		else if(blk != 0){
+			fs->dedup_slot_of[blk] = slot;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Note that an index slot changed. The first change after a write-back flags the on-disk index as stale.
+ */
+static void dedup_touch(struct tfs_fs* fs, int slot) {
+	fs->dedup_dirty[slot / DEDUP_PER_BLK] = 1;
+	if(!(fs->sb_ext.state & TFS_STATE_DEDUP_DIRTY)){
+		fs->sb_ext.state |= TFS_STATE_DEDUP_DIRTY;
+		sb_ext_store(fs);
+	}
+}
+
+/*
+ * Write the changed index blocks back and mark the on-disk index as good again (libtfs_sync() and libtfs_unmount()).
+ */
+static void dedup_flush(struct tfs_fs* fs) {
+	if(fs->dedup_table == NULL || !(fs->sb_ext.state & TFS_STATE_DEDUP_DIRTY)){
+		return;
+	}
+	int count = 0;
+	for(count = 0; count < (int)fs->sb_ext.dedup_nblks; count++){
+		if(fs->dedup_dirty[count]){
+			if(tfs_bwrite(fs, fs->sb_ext.dedup_start_blk + count, (char*)fs->dedup_table + count * BLOCK_SIZE) < 0){
+				return;				// leave the stale flag set, the next mount starts over
+			}
+			fs->dedup_dirty[count] = 0;
+		}
+	}
+	fs->sb_ext.state &= ~TFS_STATE_DEDUP_DIRTY;
+	sb_ext_store(fs);
+}
+
+/*
+ * Find an allocated block whose content is exactly buf. Returns its block number, or -1.
+ */
+static int dedup_lookup(struct tfs_fs* fs, const void* buf, uint64_t hash) {
+	char* candidate = NULL;
+	int found = -1;
+	int probe = 0;
+	for(probe = 0; probe < DEDUP_PROBE && found == -1; probe++){
+		struct dedup_entry* entry = &fs->dedup_table[(hash + probe) & (DEDUP_SLOTS - 1)];
+		if(entry->blk == 0 || entry->hash != hash){
+			continue;
+		}
+		if(candidate == NULL){
+			candidate = (char*)blkbuf_get();
+		}
+		if(tfs_dread(fs, entry->blk, candidate) == 0 && memcmp(candidate, buf, BLOCK_SIZE) == 0){
+			found = entry->blk;
+		}
+		else{
+			fs->stats.dedup_collisions++;
+		}
+	}
+	blkbuf_put(candidate);
+	return found;
+}
+
+/*
+ * Drop a block from the index, because it's being overwritten in place or freed.
+ */
+static void dedup_forget(struct tfs_fs* fs, int block_num) {
+	if(fs->dedup_table == NULL || fs->dedup_slot_of[block_num] == DEDUP_NO_SLOT){
+		return;
+	}
+	int slot = fs->dedup_slot_of[block_num];
+	fs->dedup_table[slot].blk = 0;
+	fs->dedup_slot_of[block_num] = DEDUP_NO_SLOT;
+	dedup_touch(fs, slot);
+}
+
+/*
+ * Remember that block_num holds content with this hash.
+ */
+static void dedup_insert(struct tfs_fs* fs, uint64_t hash, int block_num) {
+	dedup_forget(fs, block_num);
+	int home = hash & (DEDUP_SLOTS - 1);
+	int slot = home;
+	int probe = 0;
+	for(probe = 0; probe < DEDUP_PROBE; probe++){
+		if(fs->dedup_table[(home + probe) & (DEDUP_SLOTS - 1)].blk == 0){
+			slot = (home + probe) & (DEDUP_SLOTS - 1);
+			break;
+		}
+	}
+	if(fs->dedup_table[slot].blk != 0){
+		fs->dedup_slot_of[fs->dedup_table[slot].blk] = DEDUP_NO_SLOT;	// window is full, the home slot's entry makes room
+	}
+	fs->dedup_table[slot].hash = hash;
+	fs->dedup_table[slot].blk = block_num;
+	fs->dedup_slot_of[block_num] = slot;
+	dedup_touch(fs, slot);
+}
+
+/*
+ * Time the checksum kernels on a block-sized buffer ("tfs --bench-csum").
+ */
+int libtfs_bench_csum() {
+	crc32c_init();
+
+	unsigned char* block = (unsigned char*)malloc(BLOCK_SIZE);
+	int count = 0;
+	for(count = 0; count < BLOCK_SIZE; count++){
+		block[count] = (unsigned char)(count * 131 + 7);
+	}
+
+	const char* names[3] = { "portable", "sse4.2", "sse4.2+pclmul" };
+	uint32_t (*kernels[3])(uint32_t, const void*, size_t) = { crc32c_sw, NULL, NULL };
+#if defined(__x86_64__) && defined(__GNUC__)
+	if(__builtin_cpu_supports("sse4.2")){
+		kernels[1] = crc32c_sse42;
+		if(__builtin_cpu_supports("pclmul")){
+			kernels[2] = crc32c_pclmul;
+		}
+	}
+#endif
+
+	int iterations = 200000;
+	uint32_t reference = ~crc32c_sw(~(uint32_t)0, block, BLOCK_SIZE);
+	int k = 0;
+	for(k = 0; k < 3; k++){
+		if(kernels[k] == NULL){
+			printf("%-14s unsupported on this CPU\n", names[k]);
+			continue;
+		}
+		struct timespec start, end;
+		volatile uint32_t crc = 0;		// keeps the loop from being optimized away
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(count = 0; count < iterations; count++){
+			crc ^= kernels[k](~(uint32_t)count, block, BLOCK_SIZE);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		int agrees = (~kernels[k](~(uint32_t)0, block, BLOCK_SIZE) == reference);
+		printf("%-14s %8.1f MB/s  %6.1f ns/block  %s\n", names[k],
+		       (double)iterations * BLOCK_SIZE / secs / 1e6, secs * 1e9 / iterations,
+		       agrees ? "ok" : "MISMATCH");
+	}
+
+	free(block);
+	return 0;
+}
+
+/*
+ * LZ4 block format compression (no frame header, we keep our own lengths in struct zchunk_hdr)
+ */
+#define LZ4_MINMATCH		4
+#define LZ4_HASH_BITS		12
+#define LZ4_LAST_LITERALS	5		// the format wants the last 5 bytes to be literals
+#define LZ4_MFLIMIT		12		// and the last match to start at least 12 bytes before the end
+
+/*
+ * Write a literal/match length that didn't fit into its 4-bit token field.
+ */
+static int lz4_put_len(unsigned char* dst, int op, int len) {
+	while(len >= 255){
+		dst[op++] = 255;
+		len -= 255;
+	}
+	dst[op++] = (unsigned char)len;
+	return op;
+}
+
+/*
+ * Greedy single-pass compressor. Returns the compressed size, or -1 if it doesn't fit into dst_cap.
+ * Inputs are at most one chunk (a few blocks), so every match offset fits into 16 bits.
+ */
+static int lz4_compress(const unsigned char* src, int src_len, unsigned char* dst, int dst_cap) {
+	int table[1 << LZ4_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	int ip = 0;
+	int anchor = 0;
+	int op = 0;
+	while(ip < src_len - LZ4_MFLIMIT){
+		uint32_t seq = 0;
+		uint32_t ref_seq = 0;
+		memcpy(&seq, src + ip, 4);
+		uint32_t hash = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+		int ref = table[hash];
+		table[hash] = ip;
+		memcpy(&ref_seq, src + ref, 4);
+		if(ref >= ip || ip - ref > 65535 || ref_seq != seq){
+			ip++;
+			continue;
+		}
+
+		// Extend the match as far as it goes (but leave the last literals alone).
+		int match_len = LZ4_MINMATCH;
+		while(ip + match_len < src_len - LZ4_LAST_LITERALS && src[ref + match_len] == src[ip + match_len]){
+			match_len++;
+		}
+
+		// Worst case for this sequence: token, length bytes, literals, offset.
+		int lit_len = ip - anchor;
+		if(op + 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1 > dst_cap){
+			return -1;
+		}
+
+		int token = op++;
+		dst[token] = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4);
+		if(lit_len >= 15){
+			op = lz4_put_len(dst, op, lit_len - 15);
+		}
+		memcpy(dst + op, src + anchor, lit_len);
+		op += lit_len;
+		dst[op++] = (unsigned char)((ip - ref) & 0xff);
+		dst[op++] = (unsigned char)((ip - ref) >> 8);
+		int extra = match_len - LZ4_MINMATCH;
+		dst[token] |= (unsigned char)(extra < 15 ? extra : 15);
+		if(extra >= 15){
+			op = lz4_put_len(dst, op, extra - 15);
+		}
+
+		ip += match_len;
+		anchor = ip;
+	}
+
+	// Whatever is left goes out as one final run of literals.
+	int lit_len = src_len - anchor;
+	if(op + 1 + lit_len / 255 + 1 + lit_len > dst_cap){
+		return -1;
+	}
+	dst[op++] = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4);
+	if(lit_len >= 15){
+		op = lz4_put_len(dst, op, lit_len - 15);
+	}
+	memcpy(dst + op, src + anchor, lit_len);
+	op += lit_len;
+	return op;
+}
+
+/*
+ * Decompressor. Checks every length against both buffers, since the input comes off the disk.
+ * Returns the decompressed size, or -1 if the input is malformed.
+ */
+static int lz4_decompress(const unsigned char* src, int src_len, unsigned char* dst, int dst_cap) {
+	int ip = 0;
+	int op = 0;
+	while(ip < src_len){
+		int token = src[ip++];
+		int lit_len = token >> 4;
+		if(lit_len == 15){
+			int b = 255;
+			while(b == 255){
+				if(ip >= src_len){
+					return -1;
+				}
+				b = src[ip++];
+				lit_len += b;
+			}
+		}
+		if(ip + lit_len > src_len || op + lit_len > dst_cap){
+			return -1;
+		}
+		memcpy(dst + op, src + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if(ip == src_len){
+			break;				// the last sequence has no match part
+		}
+
+		if(ip + 2 > src_len){
+			return -1;
+		}
+		int offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op){
+			return -1;
+		}
+		int match_len = token & 15;
+		if(match_len == 15){
+			int b = 255;
+			while(b == 255){
+				if(ip >= src_len){
+					return -1;
+				}
+				b = src[ip++];
+				match_len += b;
+			}
+		}
+		match_len += LZ4_MINMATCH;
+		if(op + match_len > dst_cap){
+			return -1;
+		}
+		// Byte by byte on purpose: the match may overlap what it's producing (that's how runs get encoded).
+		int count = 0;
+		for(count = 0; count < match_len; count++){
+			dst[op + count] = dst[op - offset + count];
+		}
+		op += match_len;
+	}
+	return op;
+}
+
+/*
+ * Allocation groups
+ */
+
+/*
+ * Work out where every group's bitmaps, inode table slice and data region are (mkfs and mount).
+ */
+static void group_setup(struct tfs_fs* fs) {
+	free(fs->groups);
+
+	if(!(fs->sb_ext.features & TFS_FEAT_AGROUPS)){
+		fs->ngroups = 1;
+		fs->groups = (struct tfs_group*)calloc(1, sizeof(struct tfs_group));
+		fs->groups[0].ibitmap_blk = 1;
+		fs->groups[0].dbitmap_blk = 2;
+		fs->groups[0].itable_blk = 3;
+		fs->groups[0].data_blk = 67;
+		fs->groups[0].data_nblks = fs->sb_ext.d_end_blk - 67;	// the reserved areas sit at the end of the disk
+		fs->groups[0].first_ino = 0;
+		fs->groups[0].ninodes = MAX_INUM;
+		return;
+	}
+
+	// Group g starts at block 1 + g * ag_nblks: inode bitmap, data bitmap, inode table slice, then data.
+	fs->ngroups = fs->sb_ext.ag_count;
+	fs->groups = (struct tfs_group*)calloc(fs->ngroups, sizeof(struct tfs_group));
+	int itable_nblks = fs->sb_ext.ag_inodes / 16;
+	int g = 0;
+	for(g = 0; g < fs->ngroups; g++){
+		struct tfs_group* group = &fs->groups[g];
+		int start = 1 + g * fs->sb_ext.ag_nblks;
+		group->ibitmap_blk = start;
+		group->dbitmap_blk = start + 1;
+		group->itable_blk = start + 2;
+		group->data_blk = start + 2 + itable_nblks;
+		group->data_nblks = fs->sb_ext.ag_nblks - 2 - itable_nblks;
+		group->first_ino = g * fs->sb_ext.ag_inodes;
+		group->ninodes = fs->sb_ext.ag_inodes;
+	}
+}
+
+/*
+ * Count the free inodes and data blocks of every group from its bitmaps (mount, and the end of mkfs).
+ */
+static void group_count_free(struct tfs_fs* fs) {
+	bitmap_t bitmap = (bitmap_t)blkbuf_get();
+	int g = 0;
+	for(g = 0; g < fs->ngroups; g++){
+		struct tfs_group* group = &fs->groups[g];
+		int count = 0;
+		group->free_inodes = 0;
+		group->free_blks = 0;
+		if(tfs_bread(fs, group->ibitmap_blk, bitmap) == 0){
+			for(count = 0; count < group->ninodes; count++){
+				group->free_inodes += !get_bitmap(bitmap, count);
+			}
+		}
+		if(tfs_bread(fs, group->dbitmap_blk, bitmap) == 0){
+			for(count = 0; count < group->data_nblks; count++){
+				group->free_blks += !get_bitmap(bitmap, count);
+			}
+		}
+	}
+	blkbuf_put(bitmap);
+}
+
+static int ino_group(struct tfs_fs* fs, int ino) {
+	return ino / fs->groups[0].ninodes;
+}
+
+static int blk_group(struct tfs_fs* fs, int block_num) {
+	int g = 0;
+	for(g = fs->ngroups - 1; g > 0; g--){
+		if(block_num >= fs->groups[g].ibitmap_blk){
+			break;
+		}
+	}
+	return g;
+}
+
+/*
+ * Where a new data block for this inode should go, if there's nothing better: its own group,
+ * at the spot in the data region that lines up with where the inode sits in the inode table.
+ */
+static int ino_goal(struct tfs_fs* fs, int ino) {
+	struct tfs_group* group = &fs->groups[ino_group(fs, ino)];
+	return group->data_blk + (int)((long)(ino - group->first_ino) * group->data_nblks / group->ninodes);
+}
+
+/*
+ * Where logical block #lblk of an inode should go: right behind the block before it, so files stay contiguous.
+ */
+static int blk_goal(struct tfs_fs* fs, const struct inode* inode, int lblk) {
+	int slot = 0;
+	for(slot = lblk - 1; slot >= 0; slot--){
+		if(PTR_IS_BLK(inode->direct_ptr[slot])){
+			return PTR_BLK(inode->direct_ptr[slot]) + 1;
+		}
+	}
+	return ino_goal(fs, inode->ino);
+}
+
+/*
+ * Get available inode number from bitmap. Files go into their parent directory's group. A new directory goes
+ * into whichever group has the most free inodes, so directory trees spread out over the disk.
+ */
+int get_avail_ino(struct tfs_fs* fs, int parent_ino, int is_dir) {
+
+	int first_group = ino_group(fs, parent_ino);
+	int g = 0;
+	if(is_dir){
+		for(g = 0; g < fs->ngroups; g++){
+			if(fs->groups[g].free_inodes > fs->groups[first_group].free_inodes){
+				first_group = g;
+			}
+		}
+	}
+
+	bitmap_t inode_bitmap = (bitmap_t)blkbuf_get();			// allocate a block, even though you don't need a block
+	int tries = 0;
+	for(tries = 0; tries < fs->ngroups; tries++){
+		struct tfs_group* group = &fs->groups[(first_group + tries) % fs->ngroups];
+		if(group->free_inodes == 0){
+			continue;
+		}
+
+		// Step 1: Read inode bitmap from disk
+		if(tfs_bread(fs, group->ibitmap_blk, inode_bitmap) < 0){
+			continue;
+		}
+
+		// Step 2: Traverse inode bitmap to find an available slot
+		int count = 0;
+		for(count = 0; count < group->ninodes; count++){
+			if(get_bitmap(inode_bitmap, count) == 0){
+				// Step 3: Update inode bitmap and write to disk
+				set_bitmap(inode_bitmap, count);
+				tfs_bwrite(fs, group->ibitmap_blk, inode_bitmap);
+				group->free_inodes--;
+				blkbuf_put(inode_bitmap);
+				return group->first_ino + count;		// return the inode number
+			}
+		}
+	}
+
+	// this means we couldn't find a free spot for an inode
+	blkbuf_put(inode_bitmap);
+	return -1;
+}
+
+/*
+ * Give an inode number back.
+ */
+static void free_ino(struct tfs_fs* fs, int ino) {
+	if(fs->itimes[ino].dirty){
+		fs->itimes[ino].dirty = 0;		// whoever gets this number next starts with fresh times
+		fs->itimes_dirty--;
+	}
+	if(fs->blooms[ino].state == BLOOM_DIRTY){
+		fs->blooms_dirty--;
+	}
+	fs->blooms[ino].state = BLOOM_UNKNOWN;
+	struct tfs_group* group = &fs->groups[ino_group(fs, ino)];
+	bitmap_t inode_bitmap = (bitmap_t)blkbuf_get();
+	if(tfs_bread(fs, group->ibitmap_blk, inode_bitmap) == 0 && get_bitmap(inode_bitmap, ino - group->first_ino)){
+		unset_bitmap(inode_bitmap, ino - group->first_ino);
+		tfs_bwrite(fs, group->ibitmap_blk, inode_bitmap);
+		group->free_inodes++;
+	}
+	blkbuf_put(inode_bitmap);
+}
+
+/*
+ * Is a free data block still off limits? libtfs_read_extents() callers (FUSE's read_buf) move the data after
+ * fs->lock is let go, so a block freed around then doesn't go to another file until TFS_EXTENT_GRACE_SECS later.
+ */
+static int blk_cooling(struct tfs_fs* fs, int block_num, time_t now) {
+	return fs->reuse_at != NULL && fs->reuse_at[block_num] > now;
+}
+
+/* 
+ * Get available data block number from bitmap. The search starts at goal (an absolute block number, see blk_goal())
+ * and moves on to the following groups when that one is full. Returns the absolute block number.
+ */
+int get_avail_blkno(struct tfs_fs* fs, int goal) {
+
+	time_t now = time(NULL);
+	int first_group = blk_group(fs, goal);
+	bitmap_t data_bitmap = (bitmap_t)blkbuf_get();			// allocate a block, even though you don't need a block
+	int tries = 0;
+	for(tries = 0; tries < fs->ngroups; tries++){
+		struct tfs_group* group = &fs->groups[(first_group + tries) % fs->ngroups];
+		if(group->free_blks == 0){
+			continue;
+		}
+
+		// Step 1: Read data block bitmap from disk
+		if(tfs_bread(fs, group->dbitmap_blk, data_bitmap) < 0){
+			continue;
+		}
+
+		// Step 2: Traverse data block bitmap to find an available slot, from the goal to the end and then around
+		int start = (tries == 0) ? goal - group->data_blk : 0;
+		if(start < 0 || start >= group->data_nblks){
+			start = 0;
+		}
+		int count = 0;
+		for(count = 0; count < group->data_nblks; count++){
+			int bit = (start + count) % group->data_nblks;
+			if(get_bitmap(data_bitmap, bit) == 0 && !blk_cooling(fs, group->data_blk + bit, now)){
+				// Step 3: Update data block bitmap and write to disk
+				set_bitmap(data_bitmap, bit);
+				tfs_bwrite(fs, group->dbitmap_blk, data_bitmap);
+				group->free_blks--;
+				blkbuf_put(data_bitmap);
+				return group->data_blk + bit;
+			}
+		}
+	}
+
+	// If you haven't found any available blocks, return -1
+	blkbuf_put(data_bitmap);
+	return -1;
+}
+
+/*
+ * Get up to want data blocks at once, for preallocation. Each group's bitmap is read and written once: first we
+ * look for a free run of the whole length starting at the goal, and only if there is none take free blocks in
+ * order from there. Fills blks with absolute block numbers and returns how many it got.
+ */
+static int get_avail_run(struct tfs_fs* fs, int goal, int want, int* blks) {
+	time_t now = time(NULL);
+	int got = 0;
+	int first_group = blk_group(fs, goal);
+	bitmap_t data_bitmap = (bitmap_t)blkbuf_get();
+	int tries = 0;
+	for(tries = 0; tries < fs->ngroups && got < want; tries++){
+		struct tfs_group* group = &fs->groups[(first_group + tries) % fs->ngroups];
+		if(group->free_blks == 0 || tfs_bread(fs, group->dbitmap_blk, data_bitmap) < 0){
+			continue;
+		}
+		int start = (tries == 0) ? goal - group->data_blk : 0;
+		if(start < 0 || start >= group->data_nblks){
+			start = 0;
+		}
+
+		// Step 1: A contiguous run for everything we still need, searching from the goal
+		int need = want - got;
+		int run_start = -1;
+		int run_len = 0;
+		int bit = 0;
+		for(bit = start; bit < group->data_nblks && run_len < need; bit++){
+			if(get_bitmap(data_bitmap, bit) == 0 && !blk_cooling(fs, group->data_blk + bit, now)){
+				if(run_len == 0){
+					run_start = bit;
+				}
+				run_len++;
+			}
+			else{
+				run_len = 0;
+			}
+		}
+
+		// Step 2: Take the run, or else whatever is free
+		int count = 0;
+		for(count = 0; count < group->data_nblks && got < want; count++){
+			bit = (run_len == need) ? run_start + count : (start + count) % group->data_nblks;
+			if(get_bitmap(data_bitmap, bit) == 0 && !blk_cooling(fs, group->data_blk + bit, now)){
+				set_bitmap(data_bitmap, bit);
+				group->free_blks--;
+				blks[got++] = group->data_blk + bit;
+			}
+		}
+		tfs_bwrite(fs, group->dbitmap_blk, data_bitmap);
+	}
+	blkbuf_put(data_bitmap);
+	return got;
+}
+
+/*
+ * Block in the inode table that holds inode #ino (16 inodes per block).
+ */
+static int inode_blk(struct tfs_fs* fs, int ino) {
+	struct tfs_group* group = &fs->groups[ino_group(fs, ino)];
+	return group->itable_blk + (ino - group->first_ino) / 16;
+}
+
+/*
+ * Directory Bloom filters
+ */
+static uint64_t bloom_hash(const char* name, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;			// FNV-1a
+	size_t i = 0;
+	for(i = 0; i < len; i++){
+		h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void bloom_add_name(uint32_t* words, const char* name, size_t len) {
+	uint64_t h = bloom_hash(name, len);
+	uint32_t h1 = (uint32_t)h;
+	uint32_t h2 = (uint32_t)(h >> 32) | 1;
+	int k = 0;
+	for(k = 0; k < BLOOM_K; k++){
+		uint32_t bit = (h1 + k * h2) % BLOOM_BITS;
+		words[bit / 32] |= 1u << (bit % 32);
+	}
+}
+
+static int bloom_may_contain(const uint32_t* words, const char* name, size_t len) {
+	uint64_t h = bloom_hash(name, len);
+	uint32_t h1 = (uint32_t)h;
+	uint32_t h2 = (uint32_t)(h >> 32) | 1;
+	int k = 0;
+	for(k = 0; k < BLOOM_K; k++){
+		uint32_t bit = (h1 + k * h2) % BLOOM_BITS;
+		if(!(words[bit / 32] & (1u << (bit % 32)))){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * An empty filter for a new directory inode.
+ */
+static void bloom_init_inode(struct inode* dir_inode) {
+	memset(dir_inode->indirect_ptr, 0, sizeof(dir_inode->indirect_ptr));
+	dir_inode->indirect_ptr[BLOOM_WORDS] = (int)BLOOM_MAGIC;
+}
+
+static void bloom_dirty(struct tfs_fs* fs, int ino) {
+	if(fs->blooms[ino].state != BLOOM_DIRTY){
+		fs->blooms[ino].state = BLOOM_DIRTY;
+		fs->blooms_dirty++;
+	}
+}
+
+/*
+ * Build a directory's filter again from the names in its blocks.
+ */
+static int bloom_rebuild(struct tfs_fs* fs, const struct inode* dir_inode) {
+	uint32_t words[BLOOM_WORDS + 1];
+	memset(words, 0, sizeof(words));
+	struct dirent* block_buffer = (struct dirent*)blkbuf_get();
+	int data_block = 0;
+	int at_end = 0;
+	for(data_block = 0; data_block < 16 && !at_end && dir_inode->direct_ptr[data_block] != -1; data_block++){
+		if(tfs_bread(fs, dir_inode->direct_ptr[data_block], (void*)block_buffer) < 0){
+			blkbuf_put(block_buffer);
+			return -1;
+		}
+		int dirent_no = 0;
+		for(dirent_no = 0; dirent_no < 16 && !at_end; dirent_no++){
+			struct dirent* curr_file = &block_buffer[dirent_no];
+			if(DIRENT_UNUSED(curr_file)){
+				at_end = 1;
+			}
+			else if(curr_file->valid == 1){
+				bloom_add_name(words, curr_file->name, strlen(curr_file->name));
+			}
+		}
+	}
+	blkbuf_put(block_buffer);
+	words[BLOOM_WORDS] = BLOOM_MAGIC;
+	memcpy(fs->blooms[dir_inode->ino].words, words, sizeof(words));
+	bloom_dirty(fs, dir_inode->ino);
+	fs->stats.bloom_rebuilds++;
+	return 0;
+}
+
+/*
+ * The filter of a directory, loaded from its inode the first time. Directories from before filters existed
+ * get one built on the spot. NULL if that fails.
+ */
+static struct tfs_bloom* bloom_get(struct tfs_fs* fs, const struct inode* dir_inode) {
+	struct tfs_bloom* bloom = &fs->blooms[dir_inode->ino];
+	if(bloom->state == BLOOM_UNKNOWN){
+		memcpy(bloom->words, dir_inode->indirect_ptr, sizeof(bloom->words));
+		if((bloom->words[BLOOM_WORDS] & 0xFFFF0000) == BLOOM_MAGIC){
+			bloom->state = BLOOM_CLEAN;
+		}
+		else if(bloom_rebuild(fs, dir_inode) < 0){
+			return NULL;
+		}
+	}
+	return bloom;
+}
+
+/*
+ * Ask the filter before scanning a directory for name: 0 if it's definitely not there, 1 if it may be,
+ * 2 if there's no filter to ask.
+ */
+static int bloom_check(struct tfs_fs* fs, const struct inode* dir_inode, const char* name, size_t len) {
+	struct tfs_bloom* bloom = bloom_get(fs, dir_inode);
+	if(bloom == NULL){
+		return 2;
+	}
+	fs->stats.bloom_checks++;
+	if(!bloom_may_contain(bloom->words, name, len)){
+		fs->stats.bloom_negatives++;
+		return 0;
+	}
+	return 1;
+}
+
+static void bloom_insert(struct tfs_fs* fs, const struct inode* dir_inode, const char* name, size_t len) {
+	struct tfs_bloom* bloom = bloom_get(fs, dir_inode);
+	if(bloom != NULL){
+		bloom_add_name(bloom->words, name, len);
+		bloom_dirty(fs, dir_inode->ino);
+	}
+}
+
+/*
+ * A name went away. Its bits can't be cleared (other names may share them), so the filter only gets
+ * rebuilt once enough names are gone that it says "maybe" too often.
+ */
+static void bloom_remove(struct tfs_fs* fs, const struct inode* dir_inode) {
+	struct tfs_bloom* bloom = bloom_get(fs, dir_inode);
+	if(bloom == NULL){
+		return;
+	}
+	if((bloom->words[BLOOM_WORDS] & 0xFFFF) + 1 >= BLOOM_STALE){
+		bloom_rebuild(fs, dir_inode);
+		return;
+	}
+	bloom->words[BLOOM_WORDS]++;
+	bloom_dirty(fs, dir_inode->ino);
+}
+
+/*
+ * Copy the changed filters of the directories in one inode table block into it (see itime_fold()).
+ */
+static void bloom_fold(struct tfs_fs* fs, char* itable_block, int first_ino) {
+	int count = 0;
+	for(count = 0; count < 16 && fs->blooms_dirty > 0; count++){
+		struct tfs_bloom* bloom = &fs->blooms[first_ino + count];
+		if(bloom->state != BLOOM_DIRTY){
+			continue;
+		}
+		struct inode* inode = (struct inode*)(itable_block + count * sizeof(struct inode));
+		memcpy(inode->indirect_ptr, bloom->words, sizeof(bloom->words));
+		bloom->state = BLOOM_CLEAN;
+		fs->blooms_dirty--;
+	}
+}
+
+/*
+ * Timestamps
+ */
+static struct timespec itime_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now;
+}
+
+/*
+ * Copy the pending timestamps of every inode in one inode table block into it. Whoever writes the block
+ * takes them to disk, so they aren't pending anymore.
+ */
+static void itime_fold(struct tfs_fs* fs, char* itable_block, int first_ino) {
+	int count = 0;
+	for(count = 0; count < 16 && fs->itimes_dirty > 0; count++){
+		struct tfs_itime* it = &fs->itimes[first_ino + count];
+		if(!it->dirty){
+			continue;
+		}
+		struct inode* inode = (struct inode*)(itable_block + count * sizeof(struct inode));
+		(inode->vstat).st_atim = it->atime;
+		(inode->vstat).st_mtim = it->mtime;
+		(inode->vstat).st_ctim = it->ctime;
+		it->dirty = 0;
+		fs->itimes_dirty--;
+	}
+}
+
+/*
+ * Write all pending timestamps (and directory filters) back, one read and write per inode table block that has any.
+ */
+static void itime_flush(struct tfs_fs* fs) {
+	fs->itimes_flushed = time(NULL);
+	if(fs->itimes_dirty == 0 && fs->blooms_dirty == 0){
+		return;
+	}
+	char* buffer = (char*)blkbuf_get();
+	int first_ino = 0;
+	for(first_ino = 0; first_ino < MAX_INUM && (fs->itimes_dirty > 0 || fs->blooms_dirty > 0); first_ino += 16){
+		int count = 0;
+		while(count < 16 && !fs->itimes[first_ino + count].dirty && fs->blooms[first_ino + count].state != BLOOM_DIRTY){
+			count++;
+		}
+		if(count == 16 || tfs_bread(fs, inode_blk(fs, first_ino), buffer) < 0){
+			continue;
+		}
+		itime_fold(fs, buffer, first_ino);
+		bloom_fold(fs, buffer, first_ino);		// changed directory filters go along too
+		tfs_bwrite(fs, inode_blk(fs, first_ino), buffer);
+	}
+	blkbuf_put(buffer);
+}
+
+/*
+ * Set some of an inode's timestamps to now (which is a bitmask of ITIME_*), without writing the inode.
+ * inode is what the caller read with readi(), it gets the new times as well.
+ */
+static void itime_touch(struct tfs_fs* fs, struct inode* inode, int which) {
+	struct tfs_itime* it = &fs->itimes[inode->ino];
+	if(!it->dirty){
+		it->atime = (inode->vstat).st_atim;
+		it->mtime = (inode->vstat).st_mtim;
+		it->ctime = (inode->vstat).st_ctim;
+		it->dirty = 1;
+		fs->itimes_dirty++;
+	}
+	struct timespec now = itime_now();
+	if(which & ITIME_ATIME){
+		it->atime = now;
+	}
+	if(which & ITIME_MTIME){
+		it->mtime = now;
+	}
+	if(which & ITIME_CTIME){
+		it->ctime = now;
+	}
+	(inode->vstat).st_atim = it->atime;
+	(inode->vstat).st_mtim = it->mtime;
+	(inode->vstat).st_ctim = it->ctime;
+}
+
+/*
+ * relatime: a read only moves atime forward if the file changed since it was last read, or once a day.
+ */
+static void itime_accessed(struct tfs_fs* fs, struct inode* inode) {
+	struct timespec atime = (inode->vstat).st_atim;
+	struct timespec mtime = (inode->vstat).st_mtim;
+	struct timespec ctime = (inode->vstat).st_ctim;
+	if(atime.tv_sec < mtime.tv_sec || (atime.tv_sec == mtime.tv_sec && atime.tv_nsec <= mtime.tv_nsec) ||
+	   atime.tv_sec < ctime.tv_sec || (atime.tv_sec == ctime.tv_sec && atime.tv_nsec <= ctime.tv_nsec) ||
+	   time(NULL) - atime.tv_sec >= TFS_RELATIME_SECS){
+		itime_touch(fs, inode, ITIME_ATIME);
+	}
+}
+
+static void discard_flush(struct tfs_fs* fs);
+static void release_held(struct tfs_fs* fs);
+
+/*
+ * Commit the metadata changes made under fs->lock so far, along with the blocks they freed and the directory
+ * filters they changed, so a lookup after a crash can't miss a name whose entry made it to disk. Pending timestamps go along
+ * every TFS_ITIME_FLUSH_SECS; that's only done here, so a call can still change an entry it touched.
+ */
+static void tfs_commit(struct tfs_fs* fs) {
+	release_held(fs);
+	if((fs->jnl != NULL && fs->blooms_dirty > 0) || time(NULL) - fs->itimes_flushed >= TFS_ITIME_FLUSH_SECS){
+		itime_flush(fs);
+	}
+	journal_commit(fs);
+
+	// Freed blocks are only punched out once the bitmaps that freed them are on disk, never in the middle of a call.
+	if(fs->discard_count >= TFS_DISCARD_BATCH){
+		discard_flush(fs);
+		journal_commit(fs);		// the checksums it cleared
+	}
+}
+
+/*
+ * Every libtfs_*() call, and the maintenance thread, lets go of fs->lock through here (or commits before
+ * waiting on a condition).
+ */
+static void tfs_unlock(struct tfs_fs* fs) {
+	tfs_commit(fs);
+	pthread_mutex_unlock(&fs->lock);
+}
+
+/* 
+ * inode operations
+ */
+int readi(struct tfs_fs* fs, uint16_t ino, struct inode *inode) {
+
+  	// Step 1: Get the inode's on-disk block number
+	uint16_t block_num = inode_blk(fs, ino);		// the inode table is split up between the allocation groups
+
+  	// Step 2: Get offset of the inode in the inode on-disk block
+	uint16_t block_offset = ino % 16;
+
+  	// Step 3: Read the block from disk and then copy into inode structure
+	void* buffer = blkbuf_get();		// BUG SPOT #1 (make into an array of struct pointers?)
+	if(tfs_bread(fs, block_num, buffer) < 0){
+		blkbuf_put(buffer);
+		return -1;		// the inode table block failed its checksum, don't hand back garbage
+	}
+	memcpy(inode, buffer + block_offset * sizeof(struct inode), sizeof(struct inode));	// this pointer arithmetic should be right
+	blkbuf_put(buffer);		// once you copied it into the inode, this should be able to be freed
+
+	// Timestamps that haven't been written back yet are newer than what's on disk.
+	if(fs->itimes[ino].dirty){
+		(inode->vstat).st_atim = fs->itimes[ino].atime;
+		(inode->vstat).st_mtim = fs->itimes[ino].mtime;
+		(inode->vstat).st_ctim = fs->itimes[ino].ctime;
+	}
+	if(fs->blooms[ino].state != BLOOM_UNKNOWN){
+		memcpy(inode->indirect_ptr, fs->blooms[ino].words, sizeof(fs->blooms[ino].words));
+	}
+
+	return 0;
+}
+
+int writei(struct tfs_fs* fs, uint16_t ino, struct inode *inode) {
+
+	// Step 1: Get the block number where this inode resides on disk
+	uint16_t block_num = inode_blk(fs, ino);
+
+	// Step 2: Get the offset in the block where this inode resides on disk
+	uint16_t block_offset = ino % 16;
+
+	// Step 3: Write inode to disk
+	// Don't you check to see if this is occupied first? ANSWER: I think that's done before ever doing the writei() operation.
+	void* buffer = blkbuf_get();		// BUG SPOT #2 (make into an array of struct pointers?)
+	if(tfs_bread(fs, block_num, buffer) < 0){							// this is what was in the inode table before
+		blkbuf_put(buffer);
+		return -1;									// don't spread a corrupted block's neighbours back to disk
+	}
+	itime_fold(fs, buffer, ino - block_offset);						// pending timestamps in this block go along for free
+	memcpy(buffer + block_offset * sizeof(struct inode), inode, sizeof(struct inode));	// this pointer arithmetic should be right
+	bloom_fold(fs, buffer, ino - block_offset);						// a directory's newest filter wins over the caller's copy
+	tfs_bwrite(fs, block_num, buffer);								// FORGOT THIS STEP: write back into disk
+	blkbuf_put(buffer);										// after you write into disk, THEN YOU CAN FREE! (?)
+
+	return 0;
+}
+
+
+/* 
+ * directory operations
+ */
+int dir_find(struct tfs_fs* fs, uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+	// STATUS: I think this one is done, but double check anyway.
+
+  	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	if(readi(fs, ino, inode_buffer) == -1){	// read the inode disk block
+		free(inode_buffer);
+		return -1;
+	}
+	if(inode_buffer->type != 1){
+		free(inode_buffer);
+		return -ENOTDIR;		// a regular file has no entries, and no Bloom filter to build over its block pointers
+	}
+
+	// Step 1b: The directory's Bloom filter knows most names that aren't there without reading any blocks
+	int maybe = bloom_check(fs, inode_buffer, fname, name_len);
+	if(maybe == 0){
+		free(inode_buffer);
+		return -1;
+	}
+
+  	// Step 2: Get data block of current directory from inode
+	// In essence, go through all of the sixteen possible data blocks in the file. If you see a -1, that block is empty and you should stop.
+	int data_block = 0;
+	for(data_block = 0; data_block < 16; data_block++){
+		int curr_addr = inode_buffer->direct_ptr[data_block];
+		if(curr_addr == -1){
+			fs->stats.bloom_false_positives += (maybe == 1);
+			free(inode_buffer);	// forgot to free this at first
+			return -1;		// couldn't find the entry you wanted to look for
+		}
+		struct dirent* block_buffer = (struct dirent*)blkbuf_get();
+		if(tfs_bread(fs, curr_addr, (void*)block_buffer) < 0){	// was in the first line of the for() loop before
+			free(inode_buffer);
+			blkbuf_put(block_buffer);
+			return -1;		// corrupted directory block, treat the entry as missing
+		}
+		int dirent_no = 0;
+		for(dirent_no = 0; dirent_no < 16; dirent_no++){
+			struct dirent* curr_file = &block_buffer[dirent_no];
+			if(DIRENT_UNUSED(curr_file)){
+				fs->stats.bloom_false_positives += (maybe == 1);
+				free(inode_buffer);
+				blkbuf_put(block_buffer);
+				return -1;	// no more files can be after an unused slot
+			}
+
+			if(strcmp(curr_file->name, fname) == 0 && strlen(curr_file->name) == name_len && curr_file->valid == 1){
+				memcpy(dirent, curr_file, sizeof(struct dirent));		// can't have NULL here, seg fault (this is where the actual writing takes place)
+				free(inode_buffer);
+				blkbuf_put(block_buffer);
+				return 0;	// this was a successful return
+			}
+		}
+		blkbuf_put(block_buffer);		// prevent memory leaks
+	}
+
+	// if you got here, this means all of the data blocks were full
+	fs->stats.bloom_false_positives += (maybe == 1);
+	free(inode_buffer);
+	return -1;				// unsuccessful return
+
+}
+
+/*
+ * Write a live entry for fname into a directory block slot, clearing whatever name the slot held before
+ */
+static void dirent_fill(struct dirent* d, uint16_t f_ino, const char *fname, size_t name_len) {
+	memset(d, 0, sizeof(struct dirent));
+	d->ino = f_ino;
+	d->valid = 1;
+	memcpy(d->name, fname, name_len);	// callers keep name_len under sizeof(d->name)
+	d->len = name_len;
+}
+
+// If you have time, deal with the special cases: namely, the . and .. directories in each directory that isn't the root.
+// f_ino is the avaiable inode, for the child (I believe).
+int dir_add(struct tfs_fs* fs, struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+
+	// If you find an invalid dirent struct or an unused slot, place a dirent entry into the file system.
+	if(name_len >= sizeof(((struct dirent*)0)->name)){
+		return -1;						// has to fit in the slot with its terminator
+	}
+
+	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
+	// Step 2: Check if fname (directory name) is already used in other entries
+	int data_block = 0;
+	for(data_block = 0; data_block < 16; data_block++){
+		int curr_addr = dir_inode->direct_ptr[data_block];
+		if(curr_addr == -1){
+			// You need a new data block for the new directory. Try to get one.
+			int data_blk_num = get_avail_blkno(fs, blk_goal(fs, dir_inode, data_block));	// next to the directory's other blocks (absolute number)
+			if(data_blk_num == -1){
+				return -1;					// couldn't allocate a new block to support another data block
+			}
+
+			// If you're able to find a new block, alter the inode that you passed in as the first argument. The size of the directory will be changing for the parent.
+			dir_inode->direct_ptr[data_block] = data_blk_num;	// assign a new data block into the data block array
+			dir_inode->size += BLOCK_SIZE;				// added another block to the directory associated with the inode
+			(dir_inode->vstat).st_size += BLOCK_SIZE; 		// added another block to the directory associated with the inode
+			(dir_inode->vstat).st_blocks++;				// another block has been added, increment the block count by one
+
+			// Allocate a new buffer that will be placed into the new data block.
+			struct dirent* block_buffer = (struct dirent*)blkbuf_get();
+			memset(block_buffer, 0, BLOCK_SIZE);		// every slot unused
+
+			// Add a new entry into the buffer.
+			dirent_fill(&block_buffer[0], f_ino, fname, name_len);
+
+			tfs_bwrite(fs, data_blk_num, (void*)block_buffer);		// write the data block back into the file
+			blkbuf_put(block_buffer);					// can now free, as it persists on the file
+			writei(fs, dir_inode->ino, dir_inode);				// the parent has to know about its new block (after the block is written)
+			bloom_insert(fs, dir_inode, fname, name_len);
+			return 0;						// successful return, had to allocate a new data block
+		}
+
+		// You're working with a valid data block address.
+		struct dirent* block_buffer = (struct dirent*)blkbuf_get();
+		tfs_bread(fs, curr_addr, (void*)block_buffer);			// was in the first line of the for() loop previously
+		int dirent_no = 0;
+		for(dirent_no = 0; dirent_no < 16; dirent_no++){
+			struct dirent* curr_file = &block_buffer[dirent_no];
+			// The case of finding an unused slot in the block.
+			if(DIRENT_UNUSED(curr_file)){
+				// Add a new dirent structure into the unused slot.
+				dirent_fill(curr_file, f_ino, fname, name_len);
+
+				tfs_bwrite(fs, curr_addr, (void*)block_buffer);	// now, the modified block buffer
+				blkbuf_put(block_buffer);				// can now free, as it persists on the file
+				bloom_insert(fs, dir_inode, fname, name_len);
+				return 0;					// successful return, wrote on a pre-existing data block
+			}
+			// The case of the file being recently deleted and then invalidated.
+			if(curr_file->valid == 0){				// doing the above step in that order prevents a seg fault
+				dirent_fill(curr_file, f_ino, fname, name_len);
+				tfs_bwrite(fs, curr_addr, (void*)block_buffer);
+				blkbuf_put(block_buffer);
+				bloom_insert(fs, dir_inode, fname, name_len);
+				return 0;		// successful return, wrote on a pre-existing data block
+			}
+			if(strcmp(curr_file->name, fname) == 0 && strlen(curr_file->name) == name_len && curr_file->valid == 1){
+				blkbuf_put(block_buffer);
+				return -1;		// pre-existing entry with the same exact name, can't perform the operation
+			}
+		}
+		blkbuf_put(block_buffer);			// prevent memory leaks
+	}
+
+	// NOTE: This step is performed in the above for loop.
+	// Step 3: Add directory entry in dir_inode's data block and write to disk (after it wasn't found)
+	// Look for the first dirent struct block/data block that is either NULL or invalid (signifying deleted entries).
+	// Allocate a new data block for this directory if it does not exist (not necessary in some cases, multiple dirents in one data block)
+	// Update directory inode - what about the last modified business? Is that what we would do?
+	// TODO: Update the last modified time, but only if you have time.
+	// Write directory entry - as in, you write it to disk
+
+	// If you got here, this means there is no more space available.
+	return -1;					// not enough space to put a new entry in, all spots are filled
+}
+
+int dir_remove(struct tfs_fs* fs, struct inode dir_inode, const char *fname, size_t name_len) {
+	// STATUS: I think this one is done too, but double check anyway.
+	// I don't think you decrement the size in this method.
+
+	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+	// Step 2: Check if fname exist
+	// Step 3: If exist, then remove it from dir_inode's data block and write to disk (don't forget to write to disk!)
+	int data_block = 0;
+	for(data_block = 0; data_block < 16; data_block++){
+		int curr_addr = dir_inode.direct_ptr[data_block];
+		if(curr_addr == -1){
+			return -1;						// you couldn't find the entry you want to remove
+		}
+		struct dirent* block_buffer = (struct dirent*)blkbuf_get();
+		tfs_bread(fs, curr_addr, (void*)block_buffer);			// was previously in the first line of the for() loop
+		int dirent_no = 0;
+		for(dirent_no = 0; dirent_no < 16; dirent_no++){
+			struct dirent* curr_file = &block_buffer[dirent_no];	// pointing to the same area in memory
+			if(DIRENT_UNUSED(curr_file)){
+				blkbuf_put(block_buffer);
+				return -1;					// you couldn't find the entry you want to remove
+			}
+			if(strcmp(curr_file->name, fname) == 0 && strlen(curr_file->name) == name_len && curr_file->valid == 1){
+				curr_file->valid = 0;				// invalidate the file
+				tfs_bwrite(fs, curr_addr, (void*)block_buffer);	// write the change back into the disk file
+				blkbuf_put(block_buffer);				// free buffer after resilience has been achieved
+				bloom_remove(fs, &dir_inode);
+				return 0;					// you successfully "deleted" the file
+			}
+		}
+		blkbuf_put(block_buffer);
+	}
+
+	// All data blocks were full, and you couldn't find the file you wanted to delete.
+	return -1;
+}
+
+/*
+ * Point an existing, valid entry at a different inode and/or give it a different name, in place.
+ * Either way it's a single directory block write, which is what makes rename atomic.
+ */
+int dir_replace(struct tfs_fs* fs, struct inode dir_inode, const char *fname, size_t name_len, uint16_t new_ino, const char *new_name) {
+	if(strlen(new_name) >= sizeof(((struct dirent*)0)->name)){
+		return -1;						// same limit as dir_add()
+	}
+	int data_block = 0;
+	for(data_block = 0; data_block < 16; data_block++){
+		int curr_addr = dir_inode.direct_ptr[data_block];
+		if(curr_addr == -1){
+			return -1;						// no such entry
+		}
+		struct dirent* block_buffer = (struct dirent*)blkbuf_get();
+		if(tfs_bread(fs, curr_addr, (void*)block_buffer) < 0){
+			blkbuf_put(block_buffer);
+			return -1;
+		}
+		int dirent_no = 0;
+		for(dirent_no = 0; dirent_no < 16; dirent_no++){
+			struct dirent* curr_file = &block_buffer[dirent_no];
+			if(DIRENT_UNUSED(curr_file)){
+				blkbuf_put(block_buffer);
+				return -1;
+			}
+			if(strcmp(curr_file->name, fname) == 0 && strlen(curr_file->name) == name_len && curr_file->valid == 1){
+				dirent_fill(curr_file, new_ino, new_name, strlen(new_name));
+				tfs_bwrite(fs, curr_addr, (void*)block_buffer);
+				blkbuf_put(block_buffer);
+				if(strcmp(fname, new_name) != 0){
+					bloom_insert(fs, &dir_inode, new_name, strlen(new_name));
+					bloom_remove(fs, &dir_inode);
+				}
+				return 0;
+			}
+		}
+		blkbuf_put(block_buffer);
+	}
+	return -1;
+}
+
+/*
+ * Does this directory have any valid entries left? (rmdir/rename only replace empty directories)
+ */
+int dir_is_empty(struct tfs_fs* fs, struct inode dir_inode) {
+	int data_block = 0;
+	for(data_block = 0; data_block < 16; data_block++){
+		int curr_addr = dir_inode.direct_ptr[data_block];
+		if(curr_addr == -1){
+			break;
+		}
+		struct dirent* block_buffer = (struct dirent*)blkbuf_get();
+		tfs_bread(fs, curr_addr, (void*)block_buffer);
+		int dirent_no = 0;
+		for(dirent_no = 0; dirent_no < 16; dirent_no++){
+			struct dirent* curr_file = &block_buffer[dirent_no];
+			if(DIRENT_UNUSED(curr_file)){
+				break;
+			}
+			if(curr_file->valid == 1){
+				blkbuf_put(block_buffer);
+				return 0;
+			}
+		}
+		blkbuf_put(block_buffer);
+	}
+	return 1;
+}
+
+/*
+ * namei operation. Returns 0, or -ENOENT, -ENAMETOOLONG or -EIO (the inode's block failed its checksum).
+ */
+int get_node_by_path(struct tfs_fs* fs, const char *path, uint16_t ino, struct inode *inode) {
+	// Remember: This only takes an absolute path, as all FUSE operations do.
+	if(strlen(path) >= 252){
+		return -ENAMETOOLONG;		// same limit as split_path(), and all the room str has
+	}
+
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	// Note: You could either implement it in a iterative way or recursive way
+	char* str = (char*)malloc(252);
+	memset(str, 0, 252); 		// zero memset doesn't cause a seg fault, also ensures no foreign characters
+	strcat(str, path);
+	char* token;
+	uint16_t curr_ino_num = ino;
+
+	token = strtok(str, "/");
+
+	while(token != NULL){
+		// here is the token you want to extract information from
+		// have a dirent struct over here, also an extra variable to store the new inode number
+		struct dirent* new_dirent = (struct dirent*)malloc(sizeof(struct dirent));
+		// TODO: should this be zeroed out?
+		int success = dir_find(fs, curr_ino_num, token, strlen(token), new_dirent);
+		if(success < 0){
+			// couldn't find the desired entry, free everything then return -ENOENT (-ENOTDIR when we went through a file)
+			free(str);
+			free(new_dirent);
+			return (success == -ENOTDIR) ? -ENOTDIR : -ENOENT;
+		}
+		// what information do we want to get out of this?
+		curr_ino_num = new_dirent->ino;
+		token = strtok(NULL, "/");		// forgot this line
+		free(new_dirent);			// dir_find() copied the entry out, nothing points into it
+	}
+
+	// We forgot to populate inode struct, all of the cases.
+	// From here, we can read the inode information into inode variable.
+	memset(inode, 0, sizeof(struct inode));
+	int read_inode = readi(fs, curr_ino_num, inode);
+
+	free(str); 	// prevent memory leaks
+	return (read_inode == -1) ? -EIO : 0;	// you successfully found the path (unless the inode block was corrupted)
+}
+
+/*
+ * file data operations
+ */
+
+/*
+ * Punch the queued freed blocks out of the disk file, neighbouring blocks with one call. A queued block that has
+ * been allocated again in the meantime is left alone: each group's bitmap is checked first, and fs->lock (which
+ * the caller holds) keeps anyone from writing into a block we're about to drop until the punching is done.
+ * Only called between calls, after the journal commit that freed the blocks.
+ */
+static void discard_flush(struct tfs_fs* fs) {
+	int count = fs->discard_count;
+	int* blks = fs->discard_blks;
+	if(count == 0){
+		return;
+	}
+	fs->discard_count = 0;
+
+	// Step 1: Sort, so runs and groups line up (it's a short list)
+	int i = 0;
+	for(i = 1; i < count; i++){
+		int blk = blks[i];
+		int j = i;
+		while(j > 0 && blks[j - 1] > blk){
+			blks[j] = blks[j - 1];
+			j--;
+		}
+		blks[j] = blk;
+	}
+
+	// Step 2: Punch each run of blocks that are still free, one group at a time
+	char* csum_dirty = (fs->csum_table != NULL) ? (char*)calloc(fs->sb_ext.csum_nblks, 1) : NULL;
+	bitmap_t data_bitmap = (bitmap_t)blkbuf_get();
+	i = 0;
+	while(i < count && fs->opts.sparse){
+		int g = blk_group(fs, blks[i]);
+		struct tfs_group* group = &fs->groups[g];
+		if(tfs_bread(fs, group->dbitmap_blk, data_bitmap) < 0){
+			while(i < count && blk_group(fs, blks[i]) == g){
+				i++;				// can't tell what's free, leave the whole group alone
+			}
+			continue;
+		}
+		while(i < count && blk_group(fs, blks[i]) == g){
+			int run_start = blks[i];
+			int run_len = 0;
+			while(i < count && blks[i] == run_start + run_len && blk_group(fs, blks[i]) == g &&
+			      get_bitmap(data_bitmap, blks[i] - group->data_blk) == 0){
+				run_len++;
+				i++;
+			}
+			if(run_len == 0){
+				i++;				// allocated again since it was freed
+				continue;
+			}
+			if(dev_discard(fs, run_start, run_len) == -1){
+				continue;
+			}
+
+			// The block reads back as zeroes now, its old checksum is meaningless.
+			int blk = 0;
+			for(blk = run_start; blk < run_start + run_len && csum_dirty != NULL; blk++){
+				if(csum_covers(fs, blk) && fs->csum_table[blk] != 0){
+					fs->csum_table[blk] = 0;
+					csum_dirty[blk / CSUM_PER_BLK] = 1;
+				}
+			}
+		}
+	}
+	blkbuf_put(data_bitmap);
+
+	// Step 3: Write back the checksum blocks that changed, each once
+	for(i = 0; csum_dirty != NULL && i < (int)fs->sb_ext.csum_nblks; i++){
+		if(csum_dirty[i]){
+			dev_mwrite(fs, fs->sb_ext.csum_start_blk + i, fs->csum_table + i * CSUM_PER_BLK);
+		}
+	}
+	free(csum_dirty);
+}
+
+/*
+ * Remember a freed data block for the next discard_flush(), which tfs_commit() runs once a batch has built up.
+ */
+static void discard_queue(struct tfs_fs* fs, int block_num) {
+	if(!fs->opts.sparse){
+		return;
+	}
+	if(fs->discard_count == fs->discard_max){
+		int max = (fs->discard_max > 0) ? fs->discard_max * 2 : TFS_DISCARD_BATCH * 2;
+		int* blks = (int*)realloc(fs->discard_blks, max * sizeof(int));
+		if(blks == NULL){
+			return;			// the host just doesn't get this one back
+		}
+		fs->discard_blks = blks;
+		fs->discard_max = max;
+	}
+	fs->discard_blks[fs->discard_count++] = block_num;
+}
+
+/*
+ * Give data blocks (absolute block numbers) back, with a single bitmap read and write.
+ * A block that's shared with a clone just loses one reference and stays allocated.
+ */
+static void release_now(struct tfs_fs* fs, const int* blks, int count) {
+	if(count == 0){
+		return;
+	}
+	// Shared blocks just lose a reference.
+	char* done = (char*)calloc(count, 1);
+	int shared = 0;
+	int i = 0;
+	for(i = 0; i < count; i++){
+		if(blk_shared(fs, blks[i])){
+			fs->ref_table[blks[i]]--;
+			done[i] = 1;
+			shared++;
+		}
+	}
+	if(shared > 0){
+		ref_flush(fs, blks, count);
+	}
+
+	// The rest go back to their group's bitmap, each group's bitmap read and written once.
+	bitmap_t data_bitmap = (bitmap_t)blkbuf_get();
+	for(i = 0; i < count; i++){
+		if(done[i]){
+			continue;
+		}
+		int g = blk_group(fs, blks[i]);
+		struct tfs_group* group = &fs->groups[g];
+		tfs_bread(fs, group->dbitmap_blk, data_bitmap);
+		int j = 0;
+		for(j = i; j < count; j++){
+			if(!done[j] && blk_group(fs, blks[j]) == g){
+				unset_bitmap(data_bitmap, blks[j] - group->data_blk);	// the bitmap is relative to the group's first data block
+				dedup_forget(fs, blks[j]);
+				group->free_blks++;
+				done[j] = 2;
+			}
+		}
+		tfs_bwrite(fs, group->dbitmap_blk, data_bitmap);
+	}
+	blkbuf_put(data_bitmap);
+
+	// Directory blocks among them may still have a write pending in the journal, which is moot now.
+	// With the sparse option the host gets the space back too, once the bitmaps say the blocks are free.
+	for(i = 0; i < count; i++){
+		if(done[i] == 2){
+			journal_forget(fs, blks[i]);
+			discard_queue(fs, blks[i]);
+			if(fs->reuse_at != NULL){
+				fs->reuse_at[blks[i]] = fs->extents_at + TFS_EXTENT_GRACE_SECS;	// a splice from extents we handed out may still be reading it
+			}
+		}
+	}
+	free(done);
+}
+
+/*
+ * Give data blocks back once the current call commits. Until then the inodes on disk may still point at them
+ * (the old copy of a block written copy-on-write, say), so the call mustn't get them again and overwrite them.
+ */
+static void release_blknos(struct tfs_fs* fs, const int* blks, int count) {
+	if(count == 0){
+		return;
+	}
+	if(fs->nheld + count > fs->held_max){
+		int max = (fs->held_max > 0) ? fs->held_max : TFS_DISCARD_BATCH;
+		while(max < fs->nheld + count){
+			max *= 2;
+		}
+		int* held = (int*)realloc(fs->held_blks, max * sizeof(int));
+		if(held == NULL){
+			release_now(fs, blks, count);		// better early than leaked
+			return;
+		}
+		fs->held_blks = held;
+		fs->held_max = max;
+	}
+	memcpy(fs->held_blks + fs->nheld, blks, count * sizeof(int));
+	fs->nheld += count;
+}
+
+/*
+ * Release what the current call freed, just before it commits.
+ */
+static void release_held(struct tfs_fs* fs) {
+	int count = fs->nheld;
+	fs->nheld = 0;
+	if(count > 0){
+		release_now(fs, fs->held_blks, count);
+	}
+}
+
+/*
+ * Collect the physical blocks an inode owns (absolute block numbers) into blks. Returns how many there are.
+ */
+static int inode_blknos(const struct inode* inode, int* blks) {
+	int count = 0;
+	int slot = 0;
+	for(slot = 0; slot < 16; slot++){
+		if(PTR_IS_BLK(inode->direct_ptr[slot])){
+			blks[count++] = PTR_BLK(inode->direct_ptr[slot]);
+		}
+	}
+	return count;
+}
+
+static int chunk_is_packed(const struct inode* inode, int chunk) {
+	int head = inode->direct_ptr[chunk * ZCHUNK_BLKS];
+	return head != -1 && (head & PTR_ZHEAD);
+}
+
+/*
+ * Read logical chunk #chunk of a file into chunk_buf (ZCHUNK_SIZE bytes). Holes read back as zeroes.
+ */
+static int chunk_load(struct tfs_fs* fs, const struct inode* inode, int chunk, char* chunk_buf) {
+	int first = chunk * ZCHUNK_BLKS;
+	int slot = 0;
+	memset(chunk_buf, 0, ZCHUNK_SIZE);
+
+	// A raw chunk is just its blocks in order.
+	if(!chunk_is_packed(inode, chunk)){
+		for(slot = 0; slot < ZCHUNK_BLKS; slot++){
+			int ptr = inode->direct_ptr[first + slot];
+			if(ptr != -1 && !(ptr & PTR_UNWRITTEN) && tfs_dread(fs, ptr, chunk_buf + slot * BLOCK_SIZE) < 0){
+				return -EIO;
+			}
+		}
+		return 0;
+	}
+
+	// A compressed chunk: gather its physical blocks (head first), then decompress.
+	char* packed = (char*)blkbuf_alloc(ZCHUNK_SIZE);
+	int nblk = 0;
+	for(slot = 0; slot < ZCHUNK_BLKS; slot++){
+		int ptr = inode->direct_ptr[first + slot];
+		if(ptr == -1 || !(ptr & (PTR_ZHEAD | PTR_ZCONT))){
+			break;
+		}
+		if(tfs_dread(fs, PTR_BLK(ptr), packed + nblk * BLOCK_SIZE) < 0){
+			free(packed);
+			return -EIO;
+		}
+		nblk++;
+	}
+
+	struct zchunk_hdr hdr;
+	memcpy(&hdr, packed, sizeof(struct zchunk_hdr));
+	if(hdr.magic != ZCHUNK_MAGIC || hdr.ulen > ZCHUNK_SIZE || sizeof(struct zchunk_hdr) + hdr.clen > (size_t)nblk * BLOCK_SIZE ||
+	   lz4_decompress((unsigned char*)packed + sizeof(struct zchunk_hdr), hdr.clen, (unsigned char*)chunk_buf, hdr.ulen) != hdr.ulen){
+		fprintf(stderr, "tfs: corrupted compressed chunk at block %d\n", PTR_BLK(inode->direct_ptr[first]));
+		free(packed);
+		return -EIO;
+	}
+	free(packed);
+	return 0;
+}
+
+/*
+ * Write logical chunk #chunk back from chunk_buf, whose first ulen bytes are file data.
+ * With the compress option the chunk is packed if that saves at least one block, otherwise it goes out raw.
+ * A chunk that was raw and stays raw only rewrites the blocks in [dirty_first, dirty_last].
+ * All the blocks are allocated up front, so running out of space leaves the chunk untouched.
+ */
+static int chunk_store(struct tfs_fs* fs, struct inode* inode, int chunk, const char* chunk_buf, int ulen, int dirty_first, int dirty_last) {
+	int first = chunk * ZCHUNK_BLKS;
+	int nblk_raw = (ulen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int was_packed = chunk_is_packed(inode, chunk);
+	int slot = 0;
+
+	// Step 1: Try to compress. Only worth it if the result needs fewer blocks than the raw data.
+	char* packed = NULL;
+	int nblk_packed = 0;
+	if(fs->opts.compress && nblk_raw > 1){
+		packed = (char*)blkbuf_zalloc(ZCHUNK_SIZE);
+		int cap = (nblk_raw - 1) * BLOCK_SIZE - sizeof(struct zchunk_hdr);
+		int clen = lz4_compress((const unsigned char*)chunk_buf, ulen, (unsigned char*)packed + sizeof(struct zchunk_hdr), cap);
+		if(clen > 0){
+			struct zchunk_hdr hdr = { ZCHUNK_MAGIC, (uint16_t)ulen, (uint16_t)clen, 0 };
+			memcpy(packed, &hdr, sizeof(struct zchunk_hdr));
+			nblk_packed = (sizeof(struct zchunk_hdr) + clen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		}
+		else{
+			free(packed);
+			packed = NULL;
+		}
+	}
+
+	// Step 2: Work out the new slot layout, reusing the blocks the chunk owns right now where we can.
+	int old_blks[ZCHUNK_BLKS];
+	int n_old = 0;
+	int new_ptrs[ZCHUNK_BLKS];
+	int fresh_blks[ZCHUNK_BLKS];
+	int n_fresh = 0;
+	int cow_blks[ZCHUNK_BLKS];				// blocks shared with a clone that this chunk stops using
+	int n_cow = 0;
+	int reuse = 0;
+	int need = 0;
+	int rewrite_all = (packed != NULL || was_packed);	// the layout changes, so every slot gets rewritten
+	for(slot = 0; slot < ZCHUNK_BLKS && rewrite_all; slot++){
+		int ptr = inode->direct_ptr[first + slot];
+		if(!PTR_IS_BLK(ptr)){
+			continue;
+		}
+		// Shared (or checksummed) blocks can't be overwritten in place, they're only dropped once the new layout is written.
+		if(blk_cow(fs, PTR_BLK(ptr))){
+			cow_blks[n_cow++] = PTR_BLK(ptr);
+		}
+		else{
+			old_blks[n_old++] = PTR_BLK(ptr);
+		}
+	}
+	if(rewrite_all){
+		need = (packed != NULL) ? nblk_packed : nblk_raw;
+	}
+	for(slot = 0; slot < ZCHUNK_BLKS; slot++){
+		int ptr = inode->direct_ptr[first + slot];
+		if(!rewrite_all){
+			// Plain raw chunk: only the written blocks need somewhere to go (a new one if it's shared, copy-on-write).
+			if(slot >= dirty_first && slot <= dirty_last && ptr != -1){
+				ptr = PTR_BLK(ptr);		// a preallocated block is about to hold data
+			}
+			if(slot >= dirty_first && slot <= dirty_last && (ptr == -1 || blk_cow(fs, ptr))){
+				int blk = get_avail_blkno(fs, (slot > 0 && PTR_IS_BLK(new_ptrs[slot - 1])) ? PTR_BLK(new_ptrs[slot - 1]) + 1 : blk_goal(fs, inode, first + slot));
+				if(blk == -1){
+					break;
+				}
+				if(ptr != -1){
+					cow_blks[n_cow++] = ptr;
+				}
+				ptr = blk;
+				fresh_blks[n_fresh++] = ptr;
+			}
+			new_ptrs[slot] = ptr;
+			continue;
+		}
+		if(slot < need){
+			int blk = -1;
+			if(reuse < n_old){
+				blk = old_blks[reuse++];
+			}
+			else{
+				blk = get_avail_blkno(fs, (slot > 0 && PTR_IS_BLK(new_ptrs[slot - 1])) ? PTR_BLK(new_ptrs[slot - 1]) + 1 : blk_goal(fs, inode, first + slot));
+				if(blk == -1){
+					break;
+				}
+				fresh_blks[n_fresh++] = blk;
+			}
+			new_ptrs[slot] = (packed == NULL) ? blk : blk | (slot == 0 ? PTR_ZHEAD : PTR_ZCONT);
+		}
+		else if(packed != NULL && slot < nblk_raw){
+			new_ptrs[slot] = PTR_ZNONE;		// covered by the compressed data
+		}
+		else{
+			new_ptrs[slot] = -1;
+		}
+	}
+	if(slot < ZCHUNK_BLKS){
+		// Ran out of data blocks halfway through, hand back what we grabbed.
+		release_blknos(fs, fresh_blks, n_fresh);
+		free(packed);
+		return -ENOSPC;
+	}
+
+	// Step 3: Write the blocks out.
+	for(slot = 0; slot < ZCHUNK_BLKS; slot++){
+		int ptr = new_ptrs[slot];
+		if(!PTR_IS_BLK(ptr)){
+			continue;
+		}
+		if(!rewrite_all && (slot < dirty_first || slot > dirty_last)){
+			continue;				// untouched raw block, already on disk
+		}
+		const char* src = (packed != NULL) ? packed + slot * BLOCK_SIZE : chunk_buf + slot * BLOCK_SIZE;
+		dedup_forget(fs, PTR_BLK(ptr));
+		if(tfs_dwrite(fs, PTR_BLK(ptr), src) < 0){
+			free(packed);
+			return -EIO;
+		}
+	}
+
+	// Step 4: Point the inode at the new layout and free whatever old blocks weren't reused.
+	memcpy(&inode->direct_ptr[first], new_ptrs, sizeof(new_ptrs));
+	if(rewrite_all){
+		release_blknos(fs, old_blks + reuse, n_old - reuse);
+	}
+	release_blknos(fs, cow_blks, n_cow);
+	if(packed != NULL){
+		fs->stats.zchunks_packed++;
+		fs->stats.zblocks_saved += nblk_raw - nblk_packed;
+	}
+	else if(fs->opts.compress){
+		fs->stats.zchunks_raw++;
+	}
+	free(packed);
+	return 0;
+}
+
+/*
+ * Write len bytes into logical block #lblk of a raw (uncompressed) file, starting at blk_off in that block.
+ */
+static int file_write_block(struct tfs_fs* fs, struct inode* inode, int lblk, const char* data, int blk_off, int len) {
+	char* block = (char*)blkbuf_get();
+	int ptr = inode->direct_ptr[lblk];
+	int unwritten = (ptr != -1 && (ptr & PTR_UNWRITTEN));
+	if(unwritten){
+		ptr = PTR_BLK(ptr);			// preallocated: the block is ours, its content isn't
+	}
+	int old_ptr = ptr;
+	int shared = (ptr != -1 && blk_cow(fs, ptr));
+
+	// The block we merge into has to be read before a shared block gets swapped out below.
+	if(ptr == -1 || unwritten){
+		memset(block, 0, BLOCK_SIZE);		// brand new block, nothing on it worth reading
+	}
+	else if(len < BLOCK_SIZE && tfs_dread(fs, ptr, block) < 0){
+		blkbuf_put(block);
+		return -EIO;				// partial write into a corrupted block
+	}
+	memcpy(block + blk_off, data, len);
+
+	// With dedup on, a block that already exists somewhere just gets another reference instead of a write.
+	int dedup = (fs->opts.dedup && fs->dedup_table != NULL && fs->ref_table != NULL);
+	uint64_t hash = 0;
+	if(dedup){
+		hash = dedup_hash(block);
+		int dup = dedup_lookup(fs, block, hash);
+		if(dup != -1 && (dup == ptr || fs->ref_table[dup] < REF_MAX)){
+			fs->stats.dedup_hits++;
+			if(dup != ptr){
+				fs->ref_table[dup]++;
+				ref_flush(fs, &dup, 1);
+				if(ptr != -1){
+					release_blknos(fs, &ptr, 1);	// our old block (or our reference to it) isn't needed anymore
+				}
+				inode->direct_ptr[lblk] = dup;
+			}
+			blkbuf_put(block);
+			return 0;
+		}
+		fs->stats.dedup_misses++;
+	}
+
+	// Unallocated, or shared with a clone or checksummed (copy-on-write): the data goes into a block of our own.
+	if(ptr == -1 || shared){
+		ptr = get_avail_blkno(fs, blk_goal(fs, inode, lblk));
+		if(ptr == -1){
+			blkbuf_put(block);
+			return -ENOSPC;
+		}
+	}
+	else{
+		dedup_forget(fs, ptr);			// overwritten in place, its old content is gone
+	}
+	int ret = tfs_dwrite(fs, ptr, block);
+	blkbuf_put(block);
+	if(ret < 0){
+		if(ptr != old_ptr){
+			release_blknos(fs, &ptr, 1);
+		}
+		return -EIO;
+	}
+	if(dedup){
+		dedup_insert(fs, hash, ptr);
+	}
+
+	// Only let go of the shared copy once ours is safely on disk.
+	if(shared){
+		release_blknos(fs, &old_ptr, 1);
+	}
+	inode->direct_ptr[lblk] = ptr;
+	return 0;
+}
+
+/*
+ * Write [offset, offset + size) of a file, two or more blocks, as one batch: every block the range needs is
+ * allocated up front in one bitmap pass, the partial blocks at either end are read in parallel and merged,
+ * and then all blocks go out through dev_rw_many() at once. Not for dedup or compressed chunks.
+ */
+static int file_write_run(struct tfs_fs* fs, struct inode* inode, off_t offset, size_t size, const char* data) {
+	int lblk = offset / BLOCK_SIZE;
+	int nblk = (offset + size - 1) / BLOCK_SIZE - lblk + 1;
+	int head_off = offset % BLOCK_SIZE;
+	int tail_end = (offset + size) - (off_t)(lblk + nblk - 1) * BLOCK_SIZE;	// where the data stops in the last block
+
+	// Step 1: Which blocks need a new home (holes, and blocks that can't be overwritten in place)?
+	int old_blks[16];
+	int need_new[16];
+	int n_fresh = 0;
+	int i = 0;
+	for(i = 0; i < nblk; i++){
+		int ptr = inode->direct_ptr[lblk + i];
+		old_blks[i] = (ptr == -1) ? -1 : PTR_BLK(ptr);
+		need_new[i] = (old_blks[i] == -1 || blk_cow(fs, old_blks[i]));
+		n_fresh += need_new[i];
+	}
+
+	// Step 2: Allocate all of them at once, as one run if the group has one
+	int fresh_blks[16];
+	int got = (n_fresh > 0) ? get_avail_run(fs, blk_goal(fs, inode, lblk), n_fresh, fresh_blks) : 0;
+	if(got < n_fresh){
+		release_blknos(fs, fresh_blks, got);
+		return -ENOSPC;
+	}
+	int new_ptrs[16];
+	int cow_blks[16];
+	int n_cow = 0;
+	int next_fresh = 0;
+	for(i = 0; i < nblk; i++){
+		if(need_new[i]){
+			new_ptrs[i] = fresh_blks[next_fresh++];
+			if(old_blks[i] != -1){
+				cow_blks[n_cow++] = old_blks[i];
+			}
+		}
+		else{
+			new_ptrs[i] = old_blks[i];
+			dedup_forget(fs, old_blks[i]);		// overwritten in place, its old content is gone
+		}
+	}
+
+	// Step 3: The partial blocks at the ends get merged with what's on disk, both read at the same time
+	char* bufs[16];
+	int merge_blks[2];
+	char* merge_bufs[2];
+	int n_merge = 0;
+	for(i = 0; i < nblk; i++){
+		int partial = (i == 0 && head_off > 0) || (i == nblk - 1 && tail_end < BLOCK_SIZE);
+		if(!partial){
+			bufs[i] = (char*)data + (off_t)i * BLOCK_SIZE - head_off;	// whole block, straight from the caller
+			continue;
+		}
+		bufs[i] = (char*)blkbuf_get();
+		int ptr = inode->direct_ptr[lblk + i];
+		if(ptr == -1 || (ptr & PTR_UNWRITTEN)){
+			memset(bufs[i], 0, BLOCK_SIZE);		// brand new block, nothing on it worth reading
+		}
+		else{
+			merge_blks[n_merge] = old_blks[i];
+			merge_bufs[n_merge++] = bufs[i];
+		}
+	}
+	int ret = 0;
+	if(tfs_dread_many(fs, merge_blks, merge_bufs, n_merge) < n_merge){
+		ret = -EIO;					// partial write into a corrupted block
+	}
+	else{
+		for(i = 0; i < nblk; i++){
+			if(i == 0 && head_off > 0){
+				int len = (nblk == 1) ? (int)size : BLOCK_SIZE - head_off;
+				memcpy(bufs[i] + head_off, data, len);
+			}
+			else if(i == nblk - 1 && tail_end < BLOCK_SIZE){
+				memcpy(bufs[i], data + (off_t)i * BLOCK_SIZE - head_off, tail_end);
+			}
+		}
+
+		// Step 4: Write everything at once
+		if(tfs_dwrite_many(fs, new_ptrs, bufs, nblk) < nblk){
+			ret = -EIO;
+		}
+	}
+	for(i = 0; i < nblk; i++){
+		if((i == 0 && head_off > 0) || (i == nblk - 1 && tail_end < BLOCK_SIZE)){
+			blkbuf_put(bufs[i]);
+		}
+	}
+	if(ret < 0){
+		release_blknos(fs, fresh_blks, n_fresh);
+		return ret;
+	}
+
+	// Step 5: Point the inode at the blocks and let go of the shared copies
+	memcpy(&inode->direct_ptr[lblk], new_ptrs, nblk * sizeof(int));
+	release_blknos(fs, cow_blks, n_cow);
+	return 0;
+}
+
+/* 
+ * Make file system
+ */
+static int tfs_mkfs(struct tfs_fs* fs) {
+
+	// Call dev_create() to initialize (Create) Diskfile, unless we're reformatting one that's already open
+	int reformat = (fs->dev_fd != -1);
+	if(!reformat && (dev_create(fs) == -1 || dev_attach(fs) == -1)){
+		return -1;
+	}
+
+	// Nothing cached from a directory that was there before
+	memset(fs->blooms, 0, sizeof(fs->blooms));
+	fs->blooms_dirty = 0;
+
+	// A sparse image starts out as one big hole (a new disk file already is one), so the all-zero areas below needn't be written.
+	fs->discard_count = 0;
+	if(fs->opts.sparse && reformat){
+		dev_discard(fs, 0, TFS_NBLOCKS);
+	}
+	int zero_areas = !fs->opts.sparse;
+
+	// Fill in the superblock information.
+	struct superblock* first_block = (struct superblock*)blkbuf_zalloc(BLOCK_SIZE);		// allocate a disk block for the superblock (zeroed, the extension lives in it too)
+	first_block->magic_num = MAGIC_NUM;
+	first_block->max_inum = MAX_INUM;
+	first_block->max_dnum = MAX_DNUM;
+	// The checksum area goes at the very end of the disk, and the data region stops right before it.
+	// The reference counts go right in front of it, the dedup index in front of those and the journal in front of that.
+	memset(&fs->sb_ext, 0, sizeof(struct superblock_ext));
+	fs->sb_ext.ext_magic = TFS_EXT_MAGIC;
+	fs->sb_ext.features = TFS_FEAT_CSUM | TFS_FEAT_REFCOUNT | TFS_FEAT_DEDUP | TFS_FEAT_AGROUPS | TFS_FEAT_JOURNAL;
+	fs->sb_ext.csum_nblks = (TFS_NBLOCKS + CSUM_PER_BLK - 1) / CSUM_PER_BLK;
+	fs->sb_ext.csum_start_blk = TFS_NBLOCKS - fs->sb_ext.csum_nblks;
+	fs->sb_ext.ref_nblks = (TFS_NBLOCKS + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	fs->sb_ext.ref_start_blk = fs->sb_ext.csum_start_blk - fs->sb_ext.ref_nblks;
+	fs->sb_ext.dedup_nblks = DEDUP_NBLKS;
+	fs->sb_ext.dedup_start_blk = fs->sb_ext.ref_start_blk - fs->sb_ext.dedup_nblks;
+	fs->sb_ext.journal_nblks = TFS_JOURNAL_NBLKS;
+	fs->sb_ext.journal_start_blk = fs->sb_ext.dedup_start_blk - fs->sb_ext.journal_nblks;
+	if(fs->nstripes > 1){
+		fs->sb_ext.features |= TFS_FEAT_STRIPED;
+		fs->sb_ext.stripe_count = fs->nstripes;
+		fs->sb_ext.stripe_unit = fs->stripe_unit;
+	}
+	if(fs->meta_fd != -1){
+		fs->sb_ext.features |= TFS_FEAT_METAFILE;
+	}
+
+	// Everything between the superblock and the journal is split evenly into allocation groups,
+	// and the inodes are dealt out evenly between them.
+	fs->sb_ext.ag_count = TFS_AG_COUNT;
+	fs->sb_ext.ag_inodes = MAX_INUM / TFS_AG_COUNT;
+	fs->sb_ext.ag_nblks = (fs->sb_ext.journal_start_blk - 1) / TFS_AG_COUNT;
+	fs->sb_ext.d_end_blk = 1 + fs->sb_ext.ag_count * fs->sb_ext.ag_nblks;
+	group_setup(fs);
+
+	// The old superblock fields describe the first group, that's where the root directory lives.
+	first_block->i_bitmap_blk = fs->groups[0].ibitmap_blk;	// where the inode block bitmap is stored
+	first_block->d_bitmap_blk = fs->groups[0].dbitmap_blk;	// where the data block bitmap is stored
+	first_block->i_start_blk = fs->groups[0].itable_blk;	// where the inode table is stored
+	first_block->d_start_blk = fs->groups[0].data_blk;	// where the data blocks are stored
+	memcpy((char*)first_block + sizeof(struct superblock), &fs->sb_ext, sizeof(struct superblock_ext));
+
+	bitmap_t inode_bitmap = NULL;
+	bitmap_t datablock_bitmap = NULL;
+
+	dev_mwrite(fs, 0, first_block);				// put the superblock in the first block
+	if(fs->meta_fd != -1){
+		dev_write(fs, 0, first_block);			// and a copy in DISKFILE, so it can't be mounted without the metadata file
+	}
+	free(first_block);					// we can free the in-memory DS once it's been written to disk
+
+	// An empty journal: a header without the magic number.
+	char* journal_hdr = (char*)blkbuf_zalloc(BLOCK_SIZE);
+	dev_mwrite(fs, fs->sb_ext.journal_start_blk, journal_hdr);
+	free(journal_hdr);
+
+	// Start with an all-zero checksum area ("nothing recorded yet"). Everything below goes through tfs_bwrite(), which fills it in.
+	free(fs->csum_table);
+	fs->csum_table = (uint32_t*)blkbuf_zalloc(fs->sb_ext.csum_nblks * BLOCK_SIZE);
+	int csum_blk = 0;
+	for(csum_blk = 0; csum_blk < (int)fs->sb_ext.csum_nblks && zero_areas; csum_blk++){
+		dev_mwrite(fs, fs->sb_ext.csum_start_blk + csum_blk, fs->csum_table + csum_blk * CSUM_PER_BLK);
+	}
+
+	// No block is shared yet.
+	free(fs->ref_table);
+	fs->ref_table = (uint8_t*)blkbuf_zalloc(fs->sb_ext.ref_nblks * BLOCK_SIZE);
+	int ref_blk = 0;
+	for(ref_blk = 0; ref_blk < (int)fs->sb_ext.ref_nblks && zero_areas; ref_blk++){
+		tfs_bwrite(fs, fs->sb_ext.ref_start_blk + ref_blk, fs->ref_table + ref_blk * BLOCK_SIZE);
+	}
+
+	// Empty dedup index.
+	free(fs->dedup_table);
+	free(fs->dedup_slot_of);
+	free(fs->dedup_dirty);
+	dedup_alloc(fs);
+	int dedup_blk = 0;
+	for(dedup_blk = 0; dedup_blk < (int)fs->sb_ext.dedup_nblks && zero_areas; dedup_blk++){
+		tfs_bwrite(fs, fs->sb_ext.dedup_start_blk + dedup_blk, (char*)fs->dedup_table + dedup_blk * BLOCK_SIZE);
+	}
+
+	inode_bitmap = (bitmap_t)blkbuf_get();		// initialize the inode bitmap, allocate a whole block
+	datablock_bitmap = (bitmap_t)blkbuf_get();	// initialize the data block bitmap, allocate a whole block
+	int g = 0;
+	for(g = 0; g < fs->ngroups; g++){
+		memset(inode_bitmap, 0, BLOCK_SIZE);		// set all entries in the bitmaps to zero
+		memset(datablock_bitmap, 0, BLOCK_SIZE);
+
+		// Update bitmap information for the root directory
+		if(g == 0){
+			set_bitmap(inode_bitmap, 0);		// root is inode number 0
+			set_bitmap(datablock_bitmap, 0);	// root's first data block is the first one of group 0
+		}
+		tfs_bwrite(fs, fs->groups[g].ibitmap_blk, inode_bitmap);
+		tfs_bwrite(fs, fs->groups[g].dbitmap_blk, datablock_bitmap);
+	}
+	blkbuf_put(inode_bitmap);			// we can free() once the file has been written into
+	blkbuf_put(datablock_bitmap);			// we can free() once the file has been written into
+
+	// Initialize the first inode for the root directory.
+	struct inode* first_inode = (struct inode*)malloc(sizeof(struct inode));	// we can fit multiple inodes into one inode disk block
+	first_inode->ino = 0;			// root takes the first inode (inode #0)
+	first_inode->valid = 1;			// don't need to worry about special inode numbers, valid attribute takes care of deleted files
+	first_inode->size = BLOCK_SIZE;		// at first, directories take up one block unless added to (like in dir_add)
+	first_inode->type = 1; 			// assume "0" is regular file, "1" is directory
+	first_inode->link = 2;			// the link count is initialized to 2 in directories, and add one for each new subdirectory you add
+	bloom_init_inode(first_inode);
+	first_inode->direct_ptr[0] = fs->groups[0].data_blk;	// direct pointers hold the block addresses
+
+	// Fill in the rest of the empty direct pointers with -1, to signify that they are all empty.
+	int cnt = 1;
+	for(cnt = 1; cnt < 16; cnt++){
+		first_inode->direct_ptr[cnt] = -1;
+	}
+
+	// Fill in the stat struct with the appropriate field values, as listed on the Piazza.
+	(first_inode->vstat).st_ino = 0;			// root takes the first inode (inode #0)
+	(first_inode->vstat).st_mode = S_IFDIR | 0755;		// for a directory, assume that the permissions are 0755
+	(first_inode->vstat).st_size = BLOCK_SIZE;		// current size of the file, in bytes
+	(first_inode->vstat).st_blksize = BLOCK_SIZE;		// block size of the file system
+	(first_inode->vstat).st_blocks = 1;			// this tells us how many blocks the root currently takes up
+	(first_inode->vstat).st_atim = itime_now();		// atime, mtime and ctime all start out as the time of mkfs
+	(first_inode->vstat).st_mtim = (first_inode->vstat).st_atim;
+	(first_inode->vstat).st_ctim = (first_inode->vstat).st_atim;
+
+	char* itable_block = (char*)blkbuf_zalloc(BLOCK_SIZE);
+	memcpy(itable_block, first_inode, sizeof(struct inode));
+	tfs_bwrite(fs, fs->groups[0].itable_blk, itable_block);	// write the inode into the inode data block (no offset needed here)
+	free(itable_block);
+	free(first_inode);					// we can free() once we write the inode into the file
+
+	// Store 16 dirent structs in the first data block, all of them unused (zeroed).
+	struct dirent* dirent_buffer = (struct dirent*)blkbuf_get();
+	memset(dirent_buffer, 0, BLOCK_SIZE);
+
+	tfs_bwrite(fs, fs->groups[0].data_blk, dirent_buffer);	// place the empty dirent struct into the first data block
+	blkbuf_put(dirent_buffer);			// can free the data block buffer, as it was written into the file (persistence)
+
+	group_count_free(fs);
+
+	// From here on metadata writes go through the journal.
+	dev_flush(fs);
+	return journal_start(fs);
+}
+
+/*
+ * Background maintenance. dir_remove() only marks entries dead, so directories never shrink and lookups keep
+ * stepping over them, and files written a block at a time end up scattered. Every TFS_MAINT_SECS the
+ * maintenance thread (defrag option) goes over all inodes: it rewrites directories without their dead entries,
+ * freeing blocks that end up empty, and moves fragmented files into one contiguous run. It holds fs->lock for
+ * one inode at a time and rewrites at most defrag_rate blocks a second, so regular calls barely notice.
+ * libtfs_defrag() makes the same pass on demand, at full speed.
+ */
+
+/*
+ * Is inode #ino allocated? (The inode's own valid field isn't cleared when it's freed.)
+ */
+static int ino_in_use(struct tfs_fs* fs, int ino) {
+	struct tfs_group* group = &fs->groups[ino_group(fs, ino)];
+	bitmap_t inode_bitmap = (bitmap_t)blkbuf_get();
+	int used = (tfs_bread(fs, group->ibitmap_blk, inode_bitmap) == 0 && get_bitmap(inode_bitmap, ino - group->first_ino));
+	blkbuf_put(inode_bitmap);
+	return used;
+}
+
+/*
+ * Rewrite a directory with its live entries packed into the first blocks, and free the blocks left over
+ * (the first one always stays). Returns the number of blocks written.
+ */
+static int maint_compact_dir(struct tfs_fs* fs, struct inode* dir_inode) {
+
+	// Step 1: Collect the entries, the same way dir_find() walks them (nothing comes after an unused slot)
+	struct dirent* live = (struct dirent*)malloc(16 * 16 * sizeof(struct dirent));
+	if(live == NULL){
+		return 0;
+	}
+	int nlive = 0;
+	int ndead = 0;
+	int nblocks = 0;
+	int at_end = 0;
+	struct dirent* block_buffer = (struct dirent*)blkbuf_get();
+	for(nblocks = 0; nblocks < 16 && dir_inode->direct_ptr[nblocks] != -1; nblocks++){
+		if(at_end){
+			continue;
+		}
+		if(tfs_bread(fs, dir_inode->direct_ptr[nblocks], (void*)block_buffer) < 0){
+			blkbuf_put(block_buffer);
+			free(live);
+			return 0;				// leave a directory we can't read alone
+		}
+		int dirent_no = 0;
+		for(dirent_no = 0; dirent_no < 16 && !at_end; dirent_no++){
+			struct dirent* curr_file = &block_buffer[dirent_no];
+			if(DIRENT_UNUSED(curr_file)){
+				at_end = 1;
+			}
+			else if(curr_file->valid == 1){
+				live[nlive++] = *curr_file;		// copied out, block_buffer gets reused for the next block
+			}
+			else{
+				ndead++;
+			}
+		}
+	}
+	if(ndead == 0){
+		blkbuf_put(block_buffer);
+		free(live);
+		return 0;
+	}
+
+	// Step 2: Write the live entries back, 16 to a block, unused slots after the last one
+	int needed = (nlive + 15) / 16;
+	if(needed == 0){
+		needed = 1;
+	}
+	int b = 0;
+	for(b = 0; b < needed; b++){
+		int in_block = nlive - b * 16;
+		if(in_block > 16){
+			in_block = 16;
+		}
+		memset(block_buffer, 0, BLOCK_SIZE);
+		memcpy(block_buffer, &live[b * 16], in_block * sizeof(struct dirent));
+		if(tfs_bwrite(fs, dir_inode->direct_ptr[b], (void*)block_buffer) < 0){
+			blkbuf_put(block_buffer);
+			free(live);
+			return b;
+		}
+	}
+	blkbuf_put(block_buffer);
+	free(live);
+
+	// Step 3: Give back the blocks that are empty now
+	int freed[16];
+	int nfreed = 0;
+	for(b = needed; b < nblocks; b++){
+		freed[nfreed++] = dir_inode->direct_ptr[b];
+		dir_inode->direct_ptr[b] = -1;
+	}
+	if(nfreed > 0){
+		release_blknos(fs, freed, nfreed);
+		dir_inode->size -= nfreed * BLOCK_SIZE;
+		(dir_inode->vstat).st_size = dir_inode->size;
+		(dir_inode->vstat).st_blocks -= nfreed;
+		writei(fs, dir_inode->ino, dir_inode);
+	}
+	bloom_rebuild(fs, dir_inode);			// the dead names don't need to stay in the filter anymore
+	fs->stats.dirs_compacted++;
+	fs->stats.dirents_dropped += ndead;
+	fs->stats.dir_blocks_freed += nfreed;
+	return needed;
+}
+
+/*
+ * Move a file whose blocks aren't one contiguous run into a run of its own. Compressed files and files sharing
+ * blocks with a clone are left alone. Returns the number of blocks moved.
+ */
+static int maint_defrag_file(struct tfs_fs* fs, struct inode* inode) {
+
+	// Step 1: Is it worth it?
+	int slots[16];
+	int old_blks[16];
+	int n = 0;
+	int fragmented = 0;
+	int slot = 0;
+	for(slot = 0; slot < 16; slot++){
+		int ptr = inode->direct_ptr[slot];
+		if(ptr == -1){
+			continue;
+		}
+		if(ptr & (PTR_ZHEAD | PTR_ZCONT | PTR_ZNONE)){
+			return 0;
+		}
+		if(blk_shared(fs, PTR_BLK(ptr))){
+			return 0;
+		}
+		if(n > 0 && PTR_BLK(ptr) != old_blks[n - 1] + 1){
+			fragmented = 1;
+		}
+		slots[n] = slot;
+		old_blks[n++] = PTR_BLK(ptr);
+	}
+	if(!fragmented || fs->nretired + n > TFS_MAINT_RETIRE){
+		return 0;
+	}
+
+	// Step 2: Find a free run for all of it
+	int new_blks[16];
+	int got = get_avail_run(fs, blk_goal(fs, inode, 0), n, new_blks);
+	int i = 0;
+	for(i = 1; i < got && new_blks[i] == new_blks[i - 1] + 1; i++);
+	if(got < n || i < n){
+		release_blknos(fs, new_blks, got);
+		return 0;
+	}
+
+	// Step 3: Copy the blocks that hold data (preallocated ones have nothing to copy)
+	char* data = (char*)blkbuf_alloc(n * BLOCK_SIZE);
+	int from[16];
+	int to[16];
+	char* bufs[16];
+	int ncopy = 0;
+	for(i = 0; i < n; i++){
+		if(!(inode->direct_ptr[slots[i]] & PTR_UNWRITTEN)){
+			from[ncopy] = old_blks[i];
+			to[ncopy] = new_blks[i];
+			bufs[ncopy] = data + ncopy * BLOCK_SIZE;
+			ncopy++;
+		}
+	}
+	if(tfs_dread_many(fs, from, bufs, ncopy) < ncopy || tfs_dwrite_many(fs, to, bufs, ncopy) < ncopy){
+		free(data);
+		release_blknos(fs, new_blks, n);
+		return 0;
+	}
+	free(data);
+
+	// Step 4: Switch the inode over. The old blocks are only freed by the next pass, in case a zero-copy
+	// reader still has their extents from libtfs_read_extents().
+	for(i = 0; i < n; i++){
+		inode->direct_ptr[slots[i]] = new_blks[i] | (inode->direct_ptr[slots[i]] & PTR_UNWRITTEN);
+		fs->retired[fs->nretired++] = old_blks[i];
+	}
+	writei(fs, inode->ino, inode);
+	fs->stats.files_defragged++;
+	fs->stats.blocks_moved += n;
+	return n;
+}
+
+/*
+ * Called with fs->lock held, after every inode. Lets regular calls in, and with the rate limit waits for
+ * the next second once this one's budget is used up. Returns 1 if the pass should stop (unmount).
+ */
+static int maint_yield(struct tfs_fs* fs, int rewritten, int throttled) {
+	if(throttled){
+		fs->maint_budget -= rewritten;
+	}
+	if(throttled && fs->maint_budget <= 0){
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec++;
+		tfs_commit(fs);			// the wait lets go of fs->lock
+		while(!fs->maint_quit && pthread_cond_timedwait(&fs->maint_cond, &fs->lock, &until) != ETIMEDOUT);
+		fs->maint_budget += (fs->opts.defrag_rate > 0) ? fs->opts.defrag_rate : TFS_MAINT_RATE;
+	}
+	else{
+		tfs_unlock(fs);
+		sched_yield();
+		pthread_mutex_lock(&fs->lock);
+	}
+	return fs->maint_quit;
+}
+
+/*
+ * One pass over every inode, called with fs->lock held. Returns how many directories and files it fixed.
+ */
+static int maint_pass(struct tfs_fs* fs, int throttled) {
+	release_blknos(fs, fs->retired, fs->nretired);
+	fs->nretired = 0;
+	fs->maint_budget = (fs->opts.defrag_rate > 0) ? fs->opts.defrag_rate : TFS_MAINT_RATE;
+
+	int fixed = 0;
+	int ino = 0;
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	for(ino = 0; ino < MAX_INUM; ino++){
+		if(!ino_in_use(fs, ino) || readi(fs, ino, inode_buffer) == -1){
+			continue;
+		}
+		int rewritten = (inode_buffer->type == 1) ? maint_compact_dir(fs, inode_buffer) : maint_defrag_file(fs, inode_buffer);
+		if(rewritten > 0){
+			fixed++;
+		}
+		if(maint_yield(fs, rewritten, throttled)){
+			break;
+		}
+	}
+	free(inode_buffer);
+	fs->stats.maint_passes++;
+	return fixed;
+}
+
+static void* maint_worker(void* arg) {
+	struct tfs_fs* fs = (struct tfs_fs*)arg;
+	pthread_mutex_lock(&fs->lock);
+	while(!fs->maint_quit){
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += TFS_MAINT_SECS;
+		tfs_commit(fs);			// the wait lets go of fs->lock
+		while(!fs->maint_quit && pthread_cond_timedwait(&fs->maint_cond, &fs->lock, &until) != ETIMEDOUT);
+		if(!fs->maint_quit){
+			maint_pass(fs, 1);
+		}
+	}
+	tfs_unlock(fs);
+	return NULL;
+}
+
+static void maint_start(struct tfs_fs* fs) {
+	if(fs->opts.defrag && pthread_create(&fs->maint_thread, NULL, maint_worker, fs) == 0){
+		fs->maint_running = 1;
+	}
+}
+
+static void maint_stop(struct tfs_fs* fs) {
+	if(fs->maint_running){
+		pthread_mutex_lock(&fs->lock);
+		fs->maint_quit = 1;
+		pthread_cond_broadcast(&fs->maint_cond);
+		tfs_unlock(fs);
+		pthread_join(fs->maint_thread, NULL);
+		fs->maint_running = 0;
+	}
+	release_blknos(fs, fs->retired, fs->nretired);
+	fs->nretired = 0;
+}
+
+int libtfs_defrag(struct tfs_fs* fs) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = maint_pass(fs, 0);
+	tfs_unlock(fs);
+	return ret;
+}
+
+/*
+ * Testing hooks
+ *
+ * libtfs_set_fault() puts fault injection under the handle's block writes (see fault_pwrite()), and
+ * libtfs_check() checks an image the way fsck would. Together with the dev_reads/dev_writes counters
+ * they're what a crash test needs: crash after write #n, mount the image again, check it.
+ */
+static void fault_free(struct tfs_fault_state* f) {
+	int i = 0;
+	for(i = 0; i < TFS_FAULT_REORDER; i++){
+		free(f->undo[i].old_data);
+		free(f->undo[i].new_data);
+	}
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+}
+
+int libtfs_set_fault(struct tfs_fs* fs, const struct tfs_fault* fault) {
+	if(fault != NULL && (fault->reorder < 0 || fault->reorder > TFS_FAULT_REORDER)){
+		return -EINVAL;
+	}
+	struct tfs_fault_state* f = NULL;
+	if(fault != NULL){
+		f = (struct tfs_fault_state*)calloc(1, sizeof(struct tfs_fault_state));
+		if(f == NULL){
+			return -ENOMEM;
+		}
+		f->conf = *fault;
+		f->seed = fault->seed;
+		pthread_mutex_init(&f->lock, NULL);
+		int i = 0;
+		for(i = 0; i < fault->reorder; i++){
+			f->undo[i].old_data = (char*)blkbuf_alloc(BLOCK_SIZE);
+			f->undo[i].new_data = (char*)blkbuf_alloc(BLOCK_SIZE);
+			if(f->undo[i].old_data == NULL || f->undo[i].new_data == NULL){
+				fault_free(f);
+				return -ENOMEM;
+			}
+		}
+	}
+	pthread_mutex_lock(&fs->lock);
+	struct tfs_fault_state* old = fs->fault;
+	fs->fault = f;
+	tfs_unlock(fs);
+	if(old != NULL){
+		fault_free(old);
+	}
+	return 0;
+}
+
+int libtfs_crashed(struct tfs_fs* fs) {
+	pthread_mutex_lock(&fs->lock);
+	int crashed = (fs->fault != NULL && fs->fault->crashed);
+	tfs_unlock(fs);
+	return crashed;
+}
+
+static int check_problem(FILE* out, const char* fmt, ...) {
+	if(out != NULL){
+		va_list args;
+		va_start(args, fmt);
+		fputs("tfs check: ", out);
+		vfprintf(out, fmt, args);
+		fputc('\n', out);
+		va_end(args);
+	}
+	return 1;
+}
+
+/*
+ * Walk a directory's entries the way dir_find() does, and make sure each live one points at an allocated inode
+ * and that the directory's filter knows its name (otherwise lookups would say it isn't there).
+ */
+static int check_dir(struct tfs_fs* fs, const struct inode* dir_inode, char* linked, FILE* out) {
+	int problems = 0;
+	int at_end = 0;
+	int data_block = 0;
+	const uint32_t* bloom = NULL;
+	if(fs->blooms[dir_inode->ino].state != BLOOM_UNKNOWN){
+		bloom = fs->blooms[dir_inode->ino].words;
+	}
+	else if(((uint32_t)dir_inode->indirect_ptr[BLOOM_WORDS] & 0xFFFF0000) == BLOOM_MAGIC){
+		bloom = (const uint32_t*)dir_inode->indirect_ptr;
+	}
+	struct dirent* block_buffer = (struct dirent*)blkbuf_get();
+	for(data_block = 0; data_block < 16 && !at_end && dir_inode->direct_ptr[data_block] != -1; data_block++){
+		if(tfs_bread(fs, dir_inode->direct_ptr[data_block], (void*)block_buffer) < 0){
+			problems += check_problem(out, "directory %d: block %d can't be read", dir_inode->ino, dir_inode->direct_ptr[data_block]);
+			break;					// nothing after a bad block can be trusted
+		}
+		int dirent_no = 0;
+		for(dirent_no = 0; dirent_no < 16; dirent_no++){
+			struct dirent* curr_file = &block_buffer[dirent_no];
+			if(DIRENT_UNUSED(curr_file)){
+				at_end = 1;
+				break;
+			}
+			if(curr_file->valid != 1){
+				continue;
+			}
+			if(memchr(curr_file->name, '\0', sizeof(curr_file->name)) == NULL){
+				problems += check_problem(out, "directory %d: entry %d has an unterminated name", dir_inode->ino, data_block * 16 + dirent_no);
+				continue;
+			}
+			if(bloom != NULL && !bloom_may_contain(bloom, curr_file->name, strlen(curr_file->name))){
+				problems += check_problem(out, "directory %d: \"%s\" is missing from its Bloom filter", dir_inode->ino, curr_file->name);
+			}
+			if(curr_file->ino >= MAX_INUM || !ino_in_use(fs, curr_file->ino)){
+				problems += check_problem(out, "directory %d: \"%s\" points at free inode %d", dir_inode->ino, curr_file->name, curr_file->ino);
+			}
+			else{
+				linked[curr_file->ino] = 1;
+			}
+		}
+	}
+	blkbuf_put(block_buffer);
+	return problems;
+}
+
+static int libtfs_check_locked(struct tfs_fs* fs, FILE* out) {
+	int problems = 0;
+	int* owners = (int*)calloc(TFS_NBLOCKS, sizeof(int));		// how many inodes point at each block
+	char* linked = (char*)calloc(MAX_INUM, 1);			// inodes some directory entry points at
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	char* data_buffer = (char*)blkbuf_get();
+	if(owners == NULL || linked == NULL || inode_buffer == NULL){
+		free(owners);
+		free(linked);
+		free(inode_buffer);
+		blkbuf_put(data_buffer);
+		return -ENOMEM;
+	}
+
+	// Step 1: Every allocated inode has to be readable, and its blocks have to be in the data region
+	int ino = 0;
+	for(ino = 0; ino < MAX_INUM; ino++){
+		if(!ino_in_use(fs, ino)){
+			continue;
+		}
+		if(readi(fs, ino, inode_buffer) == -1){
+			problems += check_problem(out, "inode %d can't be read", ino);
+			continue;
+		}
+		if(inode_buffer->ino != ino || inode_buffer->valid != 1 || inode_buffer->type > 1){
+			problems += check_problem(out, "inode %d is allocated but not initialized", ino);
+			continue;
+		}
+		int slot = 0;
+		for(slot = 0; slot < 16; slot++){
+			int ptr = inode_buffer->direct_ptr[slot];
+			if(!PTR_IS_BLK(ptr)){
+				continue;
+			}
+			int blk = PTR_BLK(ptr);
+			struct tfs_group* group = &fs->groups[blk_group(fs, blk)];
+			if(blk < group->data_blk || blk >= group->data_blk + group->data_nblks){
+				problems += check_problem(out, "inode %d: block %d is outside the data region", ino, blk);
+				continue;
+			}
+			owners[blk]++;
+			if(inode_buffer->type == 0 && fs->opts.csum_data && !(ptr & PTR_UNWRITTEN) && tfs_dread(fs, blk, data_buffer) < 0){
+				problems += check_problem(out, "inode %d: data block %d fails its checksum", ino, blk);
+			}
+		}
+		if(inode_buffer->type == 1){
+			problems += check_dir(fs, inode_buffer, linked, out);
+		}
+	}
+
+	// Step 2: Every allocated inode but the root needs a directory entry
+	for(ino = 1; ino < MAX_INUM; ino++){
+		if(!linked[ino] && ino_in_use(fs, ino)){
+			problems += check_problem(out, "inode %d is allocated but no directory entry points at it", ino);
+		}
+	}
+
+	// Step 3: The data bitmaps and reference counts have to agree with the owners we counted
+	int i = 0;
+	for(i = 0; i < fs->nretired; i++){
+		owners[fs->retired[i]]++;			// still marked in use until the next maintenance pass
+	}
+	bitmap_t bitmap = (bitmap_t)blkbuf_get();
+	int g = 0;
+	for(g = 0; g < fs->ngroups; g++){
+		struct tfs_group* group = &fs->groups[g];
+		int ret = tfs_bread(fs, group->dbitmap_blk, bitmap);
+		if(ret < 0){
+			problems += check_problem(out, "group %d: data bitmap can't be read", g);
+			continue;
+		}
+		for(i = 0; i < group->data_nblks; i++){
+			int blk = group->data_blk + i;
+			int used = get_bitmap(bitmap, i);
+			int expected = (fs->ref_table != NULL) ? fs->ref_table[blk] + 1 : 1;
+			if(owners[blk] > 0 && !used){
+				problems += check_problem(out, "block %d is in use but free in the bitmap", blk);
+			}
+			else if(owners[blk] == 0 && used){
+				problems += check_problem(out, "block %d is marked in use but nothing points at it", blk);
+			}
+			else if(owners[blk] > 0 && owners[blk] != expected){
+				problems += check_problem(out, "block %d has %d owners, its reference count says %d", blk, owners[blk], expected);
+			}
+		}
+	}
+	blkbuf_put(bitmap);
+	blkbuf_put(data_buffer);
+	free(inode_buffer);
+	free(linked);
+	free(owners);
+	return problems;
+}
+
+int libtfs_check(struct tfs_fs* fs, FILE* out) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_check_locked(fs, out);
+	tfs_unlock(fs);
+	return ret;
+}
+
+
+/*
+ * Mounting and unmounting
+ */
+struct tfs_fs* libtfs_mount(const char *diskfile_path, const struct tfs_options *opts) {
+
+	crc32c_init();				// pick the checksum kernel before any block gets read or written
+
+	if(strlen(diskfile_path) >= PATH_MAX){
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	struct tfs_fs* fs = (struct tfs_fs*)calloc(1, sizeof(struct tfs_fs));
+	if(fs == NULL){
+		return NULL;
+	}
+	memcpy(fs->diskfile_path, diskfile_path, strlen(diskfile_path) + 1);
+	if(opts != NULL){
+		fs->opts = *opts;
+	}
+	fs->dev_fd = -1;
+	fs->meta_fd = -1;
+	pthread_mutex_init(&fs->lock, NULL);
+	pthread_cond_init(&fs->maint_cond, NULL);
+	fs->itimes = (struct tfs_itime*)calloc(MAX_INUM, sizeof(struct tfs_itime));
+	fs->itimes_flushed = time(NULL);
+	if(fs->itimes == NULL){
+		free(fs);
+		return NULL;
+	}
+	int stripe_ret = stripe_setup(fs);
+	if(stripe_ret < 0){
+		if(stripe_ret == -EINVAL){
+			fprintf(stderr, "tfs: too many backing files (at most %d)\n", TFS_MAX_STRIPES);
+		}
+		else{
+			fprintf(stderr, "tfs: backing file path too long\n");
+		}
+		free(fs->stripes);
+		free(fs->itimes);
+		free(fs);
+		errno = -stripe_ret;
+		return NULL;
+	}
+
+	// Step 1a: If disk file is not found, call mkfs
+	if(dev_attach(fs) == -1){
+		// Don't format over an existing DISKFILE just because one of the other backing files is missing.
+		if(((fs->nstripes > 1 || fs->opts.meta != NULL) && access(fs->diskfile_path, F_OK) == 0) || tfs_mkfs(fs) == -1){
+			free(fs->stripes);
+			free(fs->itimes);
+			free(fs);
+			return NULL;
+		}
+		maint_start(fs);
+		return fs;
+	}
+
+	// Step 1b: If disk file is found, just initialize in-memory data structures (in our case, the checksum table)
+  	// and read superblock from disk
+	struct superblock* superblock_buffer = (struct superblock*)blkbuf_get();
+	int bad_sb = (dev_mread(fs, 0, superblock_buffer) < 0 || superblock_buffer->magic_num != MAGIC_NUM);
+	if(bad_sb && fs->meta_fd != -1 && dev_read(fs, 0, superblock_buffer) >= 0 && superblock_buffer->magic_num == MAGIC_NUM){
+		bad_sb = -1;			// a good DISKFILE with an empty or foreign metadata file, that's not ours to reformat
+	}
+	if(bad_sb == 1){
+		tfs_mkfs(fs);			// if the right value of the superblock is not found, reformat
+	}
+	else{
+		memcpy(&fs->sb_ext, (char*)superblock_buffer + sizeof(struct superblock), sizeof(struct superblock_ext));
+		if(fs->sb_ext.ext_magic != TFS_EXT_MAGIC){
+			// Image from before the extended superblock: no checksum area, data region runs to the end of the disk.
+			memset(&fs->sb_ext, 0, sizeof(struct superblock_ext));
+			fs->sb_ext.csum_start_blk = TFS_NBLOCKS;
+			fs->sb_ext.d_end_blk = (67 + MAX_DNUM < TFS_NBLOCKS) ? 67 + MAX_DNUM : TFS_NBLOCKS;
+		}
+
+		// Metadata has to come from where the image keeps it.
+		if(bad_sb == -1 || !(fs->sb_ext.features & TFS_FEAT_METAFILE) != (fs->meta_fd == -1)){
+			if(bad_sb == -1 && (fs->sb_ext.features & TFS_FEAT_METAFILE)){
+				fprintf(stderr, "tfs: %s isn't the metadata file of %s\n", fs->opts.meta, fs->diskfile_path);
+			}
+			else{
+				fprintf(stderr, "tfs: %s %s\n", fs->diskfile_path, (fs->sb_ext.features & TFS_FEAT_METAFILE) ?
+					"keeps its metadata in a separate file, give it with -o meta=" : "has no separate metadata file");
+			}
+			blkbuf_put(superblock_buffer);
+			dev_detach(fs);
+			free(fs->stripes);
+			free(fs->itimes);
+			free(fs);
+			errno = EINVAL;
+			return NULL;
+		}
+
+		// A striped image has to be mounted with the same backing files it was made with (block 0 is always
+		// at the start of DISKFILE, so the superblock reads right either way).
+		int want_stripes = (fs->sb_ext.features & TFS_FEAT_STRIPED) ? (int)fs->sb_ext.stripe_count : 1;
+		if(want_stripes != ((fs->nstripes > 1) ? fs->nstripes : 1)){
+			fprintf(stderr, "tfs: %s is striped over %d backing files, %d given\n", fs->diskfile_path, want_stripes,
+				(fs->nstripes > 1) ? fs->nstripes : 1);
+			blkbuf_put(superblock_buffer);
+			dev_detach(fs);
+			free(fs->stripes);
+			free(fs->itimes);
+			free(fs);
+			errno = EINVAL;
+			return NULL;
+		}
+		if(fs->sb_ext.features & TFS_FEAT_STRIPED){
+			fs->stripe_unit = fs->sb_ext.stripe_unit;
+		}
+
+		// Finish the last commit before anything below reads metadata. It may have changed block #0 as well.
+		if(fs->sb_ext.features & TFS_FEAT_JOURNAL){
+			int replayed = journal_replay(fs);
+			if(replayed > 0){
+				fprintf(stderr, "tfs: replayed %d metadata blocks from the journal\n", replayed);
+				if(dev_mread(fs, 0, superblock_buffer) >= 0){
+					memcpy(&fs->sb_ext, (char*)superblock_buffer + sizeof(struct superblock), sizeof(struct superblock_ext));
+				}
+			}
+			if(journal_start(fs) == -1){
+				blkbuf_put(superblock_buffer);
+				dev_detach(fs);
+				free(fs->stripes);
+				free(fs->itimes);
+				free(fs);
+				errno = ENOMEM;
+				return NULL;
+			}
+		}
+		if((fs->sb_ext.features & TFS_FEAT_CSUM) && csum_load(fs) == -1){
+			fprintf(stderr, "tfs: couldn't read the checksum area, mounting without verification\n");
+		}
+		if((fs->sb_ext.features & TFS_FEAT_REFCOUNT) && ref_load(fs) == -1){
+			fprintf(stderr, "tfs: couldn't read the reference count area\n");
+		}
+		if(fs->sb_ext.features & TFS_FEAT_DEDUP){
+			dedup_load(fs);
+		}
+		group_setup(fs);
+		group_count_free(fs);
+	}
+
+	blkbuf_put(superblock_buffer); 		// free() the superblock buffer once we're done using it
+	maint_start(fs);
+	return fs;
+}
+
+int libtfs_sync(struct tfs_fs* fs) {
+	// Everything is written through except the dedup index, timestamp-only changes and blocks waiting to be discarded.
+	pthread_mutex_lock(&fs->lock);
+	itime_flush(fs);
+	dedup_flush(fs);
+	tfs_commit(fs);
+	discard_flush(fs);
+	tfs_unlock(fs);
+	return 0;
+}
+
+void libtfs_unmount(struct tfs_fs* fs) {
+
+	// Step 1: Stop the maintenance thread, write back and de-allocate in-memory data structures
+	maint_stop(fs);
+	libtfs_sync(fs);
+	journal_stop(fs);
+	free(fs->csum_table);
+	free(fs->dedup_table);
+	free(fs->dedup_slot_of);
+	free(fs->dedup_dirty);
+	free(fs->ref_table);
+	free(fs->itimes);
+	free(fs->groups);
+	free(fs->discard_blks);
+	free(fs->held_blks);
+	free(fs->reuse_at);
+
+	// Step 2: Close diskfile
+	dev_detach(fs);
+	free(fs->stripes);
+	if(fs->fault != NULL){
+		fault_free(fs->fault);
+	}
+	pthread_mutex_destroy(&fs->lock);
+	pthread_cond_destroy(&fs->maint_cond);
+	free(fs);
+}
+
+const struct tfs_stats* libtfs_get_stats(struct tfs_fs* fs) {
+	return &fs->stats;
+}
+
+void libtfs_report(struct tfs_fs* fs, FILE* out) {
+	if(fs->csum_table != NULL){
+		fprintf(out, "tfs: %lu blocks verified, %lu checksum errors\n", fs->stats.csum_verified, fs->stats.csum_errors);
+	}
+	if(fs->opts.dedup){
+		fprintf(out, "tfs: dedup %lu hits, %lu misses, %lu hash collisions\n",
+			fs->stats.dedup_hits, fs->stats.dedup_misses, fs->stats.dedup_collisions);
+	}
+	if(fs->opts.compress){
+		fprintf(out, "tfs: %lu chunks compressed (%lu blocks saved), %lu stored raw\n",
+			fs->stats.zchunks_packed, fs->stats.zblocks_saved, fs->stats.zchunks_raw);
+	}
+	if(fs->opts.sparse){
+		fprintf(out, "tfs: %lu freed blocks given back to the host in %lu calls\n", fs->stats.discarded_blocks, fs->stats.discard_calls);
+	}
+	if(fs->stats.maint_passes > 0){
+		fprintf(out, "tfs: %lu maintenance passes, %lu directories compacted (%lu dead entries, %lu blocks freed), %lu files defragmented (%lu blocks moved)\n",
+			fs->stats.maint_passes, fs->stats.dirs_compacted, fs->stats.dirents_dropped, fs->stats.dir_blocks_freed,
+			fs->stats.files_defragged, fs->stats.blocks_moved);
+	}
+	if(fs->stats.journal_commits > 0){
+		fprintf(out, "tfs: %lu journal commits, %lu metadata blocks logged, %lu write barriers\n",
+			fs->stats.journal_commits, fs->stats.journal_blocks, fs->stats.dev_flushes);
+	}
+	if(fs->stats.dev_writes_dropped > 0){
+		fprintf(out, "tfs: %lu of %lu block writes dropped by fault injection\n", fs->stats.dev_writes_dropped, fs->stats.dev_writes);
+	}
+	if(fs->stats.bloom_checks > 0){
+		fprintf(out, "tfs: %lu directory lookups checked the Bloom filter, %lu answered without a scan, %lu false positives, %lu rebuilds\n",
+			fs->stats.bloom_checks, fs->stats.bloom_negatives, fs->stats.bloom_false_positives, fs->stats.bloom_rebuilds);
+	}
+}
+
+/*
+ * File system operations
+ */
+static int libtfs_getattr_locked(struct tfs_fs* fs, const char *path, struct stat *stbuf) {
+	// Note: This function gets activated when you perform ls -l or stat on a given file/directory.
+	// Plan of action: test this function first, on the root directory.
+
+	// Step 1: call get_node_by_path() to get inode from path
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	int node_find = get_node_by_path(fs, path, 0, inode_buffer);		// assume you always start from the root, as in recitation
+	if(node_find < 0){
+		free(inode_buffer);
+		return node_find;						// no such file or directory exists (or the path is too long)
+	}
+
+	// Step 2: fill attribute of file into stbuf from inode
+	// Fill all of the relevant fields of the stat structure. (Some of these fields are redundant with the inode fields?)
+	stbuf->st_ino = inode_buffer->ino;
+	stbuf->st_mode = (inode_buffer->vstat).st_mode;
+	stbuf->st_size = inode_buffer->size;
+	stbuf->st_blksize = (inode_buffer->vstat).st_blksize;
+	stbuf->st_blocks = (inode_buffer->vstat).st_blocks;
+	stbuf->st_atim = (inode_buffer->vstat).st_atim;			// readi() already put any pending timestamps in
+	stbuf->st_mtim = (inode_buffer->vstat).st_mtim;
+	stbuf->st_ctim = (inode_buffer->vstat).st_ctim;
+
+	// I think this part works, as tested by a print statement with the "/" directory.
+	free(inode_buffer);
+	return 0;
+}
+
+int libtfs_getattr(struct tfs_fs* fs, const char *path, struct stat *stbuf) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_getattr_locked(fs, path, stbuf);
+	tfs_unlock(fs);
+	return ret;
+}
+
+static int libtfs_readdir_locked(struct tfs_fs* fs, const char *path, void *buffer, libtfs_filldir_t filler) {
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	int get_node = get_node_by_path(fs, path, 0, inode_buffer);
+	if(get_node < 0){
+		free(inode_buffer);
+		return get_node;
+	}
+	if(inode_buffer->type != 1){
+		free(inode_buffer);
+		return -ENOTDIR;
+	}
+
+	// Step 2: Read directory entries from its data blocks, and copy them to filler
+	// Go through all of the possible data blocks until you find something null. Don't copy it over if the valid attribute it zero.
+	// Note: will have to use fuse_fill_dir_t filler, one of the fuse attributes. How exactly do we use this? (online documentation)
+	int data_block = 0;
+	for(data_block = 0; data_block < 16; data_block++){
+		int curr_addr = inode_buffer->direct_ptr[data_block];
+		if(curr_addr == -1){
+			break;				// break out of the loop
+		}
+		struct dirent* block_buffer = (struct dirent*)blkbuf_get();
+		tfs_bread(fs, curr_addr, (void*)block_buffer);
+		int dirent_no = 0;
+		for(dirent_no = 0; dirent_no < 16; dirent_no++){
+			struct dirent* curr_file = &block_buffer[dirent_no];
+			if(DIRENT_UNUSED(curr_file)){
+				break;			// you will end up in the 
+			}
+			// Only read valid file directory entries.
+			if(curr_file->valid == 1){
+				// Fill the buffer with all of the information.
+				filler(buffer, curr_file->name, NULL, 0);
+			}
+		}
+		blkbuf_put(block_buffer);			// prevent memory leaks; don't do it in the for loop (don't want to double free)
+	}
+
+	itime_accessed(fs, inode_buffer);		// listing a directory reads it
+	free(inode_buffer);				// wait until the end to free it
+	return 0;
+}
+
+int libtfs_readdir(struct tfs_fs* fs, const char *path, void *buffer, libtfs_filldir_t filler) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_readdir_locked(fs, path, buffer, filler);
+	tfs_unlock(fs);
+	return ret;
+}
+
+
+/*
+ * Split an absolute path into its parent directory and last component, for the handlers below.
+ * parent and child need room for 252 bytes each.
+ */
+static int split_path(const char *path, char *parent, char *child) {
+	int len = strlen(path);
+	if(len >= 252){
+		return -1;				// path name too long, same limit as tfs_mkdir()/tfs_create()
+	}
+	int split_point = len;
+	while(split_point > 0 && path[split_point] != '/'){
+		split_point--;
+	}
+	memset(parent, 0, 252);
+	memset(child, 0, 252);
+	memcpy(parent, path, split_point);
+	memcpy(child, path + split_point + 1, len - (split_point + 1));
+	return 0;
+}
+
+/*
+ * Shared by mkdir and create: allocate an inode and its first block, write the inode, and add the entry to the
+ * parent last. Whatever was taken is given back if a later step fails.
+ */
+static int make_node(struct tfs_fs* fs, const char *path, mode_t mode, int is_dir) {
+
+	// Step 1: Use split_path() to separate parent directory path and target name
+	char parent_name[252];
+	char child_name[252];
+	if(split_path(path, parent_name, child_name) == -1){
+		return -ENAMETOOLONG;
+	}
+	if(child_name[0] == '\0'){
+		return -EEXIST;					// "/" itself
+	}
+	if(strlen(child_name) >= sizeof(((struct dirent*)0)->name)){
+		return -ENAMETOOLONG;				// doesn't fit in a directory entry
+	}
+
+	// Step 2: The parent has to be a directory that doesn't have the name yet (the Bloom filter usually answers that)
+	struct inode parent_inode;
+	struct dirent entry;
+	int ret = get_node_by_path(fs, parent_name, 0, &parent_inode);
+	if(ret < 0){
+		return ret;
+	}
+	if(parent_inode.type != 1){
+		return -ENOTDIR;
+	}
+	if(dir_find(fs, parent_inode.ino, child_name, strlen(child_name), &entry) == 0){
+		return -EEXIST;
+	}
+
+	// Step 3: Call get_avail_ino() and get_avail_blkno() for the inode and its first block (bitmaps are set internally)
+	int ino = get_avail_ino(fs, parent_inode.ino, is_dir);		// files stay in their parent's group, directories spread out
+	if(ino == -1){
+		return -ENOSPC;
+	}
+	int blk = get_avail_blkno(fs, ino_goal(fs, ino));		// near the new inode
+	if(blk == -1){
+		free_ino(fs, ino);
+		return -ENOSPC;
+	}
+
+	// Step 4: Fill in the inode and write it to disk
+	struct inode child_inode;
+	memset(&child_inode, 0, sizeof(struct inode));
+	child_inode.ino = ino;
+	child_inode.valid = 1;
+	child_inode.type = is_dir;				// "1" signifies a directory, "0" a file
+	child_inode.link = is_dir ? 2 : 1;
+	int iter = 0;
+	for(iter = 0; iter < 16; iter++){
+		child_inode.direct_ptr[iter] = -1;
+	}
+	if(is_dir){
+		// The block may have belonged to something else, so an empty directory block has to be written.
+		char* block_buffer = (char*)blkbuf_get();
+		memset(block_buffer, 0, BLOCK_SIZE);
+		tfs_bwrite(fs, blk, block_buffer);
+		blkbuf_put(block_buffer);
+		child_inode.direct_ptr[0] = blk;
+		child_inode.size = BLOCK_SIZE;
+		bloom_init_inode(&child_inode);			// no names yet
+	}
+	else{
+		child_inode.direct_ptr[0] = blk | PTR_UNWRITTEN;	// may still hold a deleted file's data, read it back as zeroes
+		child_inode.size = 0;
+	}
+	(child_inode.vstat).st_ino = ino;
+	(child_inode.vstat).st_mode = mode | (is_dir ? S_IFDIR : S_IFREG);	// type specification bits may not be set, according to FUSE documentation
+	(child_inode.vstat).st_size = child_inode.size;
+	(child_inode.vstat).st_blksize = BLOCK_SIZE;
+	(child_inode.vstat).st_blocks = 1;
+	(child_inode.vstat).st_atim = itime_now();
+	(child_inode.vstat).st_mtim = (child_inode.vstat).st_atim;
+	(child_inode.vstat).st_ctim = (child_inode.vstat).st_atim;
+	if(writei(fs, ino, &child_inode) == -1){
+		release_blknos(fs, &blk, 1);
+		free_ino(fs, ino);
+		return -EIO;
+	}
+
+	// Step 5: Call dir_add() to add the entry to the parent directory
+	if(dir_add(fs, &parent_inode, ino, child_name, strlen(child_name)) == -1){
+		release_blknos(fs, &blk, 1);
+		free_ino(fs, ino);
+		return -ENOSPC;					// the parent has no room left
+	}
+	itime_touch(fs, &parent_inode, ITIME_MTIME | ITIME_CTIME);	// the parent got a new entry
+	return 0;
+}
+
+/*
+ * Shared by rmdir and unlink: drop the entry from the parent first, then give back the blocks and the inode.
+ */
+static int remove_node(struct tfs_fs* fs, const char *path, int is_dir) {
+
+	// Step 1: Use split_path() to separate parent directory path and target name
+	char parent_name[252];
+	char child_name[252];
+	if(split_path(path, parent_name, child_name) == -1){
+		return -ENAMETOOLONG;
+	}
+	if(child_name[0] == '\0'){
+		return -EBUSY;					// the root can't go
+	}
+
+	// Step 2: Call get_node_by_path() to get the parent and the target
+	struct inode parent_inode;
+	struct inode target;
+	int ret = get_node_by_path(fs, parent_name, 0, &parent_inode);
+	if(ret == 0){
+		ret = get_node_by_path(fs, path, 0, &target);
+	}
+	if(ret < 0){
+		return ret;
+	}
+	if(is_dir && target.type != 1){
+		return -ENOTDIR;
+	}
+	if(!is_dir && target.type == 1){
+		return -EISDIR;
+	}
+	if(is_dir && !dir_is_empty(fs, target)){
+		return -ENOTEMPTY;
+	}
+
+	// Step 3: Call dir_remove() to remove the entry from the parent directory
+	if(dir_remove(fs, parent_inode, child_name, strlen(child_name)) == -1){
+		return -ENOENT;
+	}
+	itime_touch(fs, &parent_inode, ITIME_MTIME | ITIME_CTIME);
+
+	// Step 4: Clear the data block bitmap and the inode bitmap
+	// Files can have holes and compressed chunks, so collect the blocks it really owns instead of stopping at the first -1.
+	int owned_blks[16];
+	release_blknos(fs, owned_blks, inode_blknos(&target, owned_blks));
+	free_ino(fs, target.ino);
+	return 0;
+}
+
+static int libtfs_mkdir_locked(struct tfs_fs* fs, const char *path, mode_t mode) {
+	return make_node(fs, path, mode, 1);
+}
+
+int libtfs_mkdir(struct tfs_fs* fs, const char *path, mode_t mode) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_mkdir_locked(fs, path, mode);
+	tfs_unlock(fs);
+	return ret;
+}
+
+static int libtfs_rmdir_locked(struct tfs_fs* fs, const char *path) {
+	return remove_node(fs, path, 1);
+}
+
+int libtfs_rmdir(struct tfs_fs* fs, const char *path) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_rmdir_locked(fs, path);
+	tfs_unlock(fs);
+	return ret;
+}
+
+static int libtfs_create_locked(struct tfs_fs* fs, const char *path, mode_t mode) {
+	return make_node(fs, path, mode, 0);
+}
+
+int libtfs_create(struct tfs_fs* fs, const char *path, mode_t mode) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_create_locked(fs, path, mode);
+	tfs_unlock(fs);
+	return ret;
+}
+
+static int libtfs_open_locked(struct tfs_fs* fs, const char *path) {
+
+	// Note: this follows the same process as tfs_opendir().
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode* ino_buf = (struct inode*)malloc(sizeof(struct inode));
+	int grab_node = get_node_by_path(fs, path, 0, ino_buf);
+
+	// Step 2: If not find, return -ENOENT
+	if(grab_node < 0){
+		free(ino_buf);
+		return grab_node;
+	}
+
+	free(ino_buf);
+	return 0;
+}
+
+int libtfs_open(struct tfs_fs* fs, const char *path) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_open_locked(fs, path);
+	tfs_unlock(fs);
+	return ret;
+}
+
+/*
+ * Set atime and mtime like utimensat(): tv == NULL means now for both, and UTIME_NOW/UTIME_OMIT work per field.
+ * ctime always becomes now. Like any other timestamp-only change this waits in memory for the next writeback.
+ */
+static int libtfs_utimens_locked(struct tfs_fs* fs, const char *path, const struct timespec tv[2]) {
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	int found = get_node_by_path(fs, path, 0, inode_buffer);
+	if(found < 0){
+		free(inode_buffer);
+		return found;
+	}
+
+	itime_touch(fs, inode_buffer, ITIME_CTIME);
+	struct tfs_itime* it = &fs->itimes[inode_buffer->ino];
+	struct timespec now = it->ctime;
+	if(tv == NULL || tv[0].tv_nsec == UTIME_NOW){
+		it->atime = now;
+	}
+	else if(tv[0].tv_nsec != UTIME_OMIT){
+		it->atime = tv[0];
+	}
+	if(tv == NULL || tv[1].tv_nsec == UTIME_NOW){
+		it->mtime = now;
+	}
+	else if(tv[1].tv_nsec != UTIME_OMIT){
+		it->mtime = tv[1];
+	}
+
+	free(inode_buffer);
+	return 0;
+}
+
+int libtfs_utimens(struct tfs_fs* fs, const char *path, const struct timespec tv[2]) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_utimens_locked(fs, path, tv);
+	tfs_unlock(fs);
+	return ret;
+}
+
+static int libtfs_read_locked(struct tfs_fs* fs, const char *path, char *buffer, size_t size, off_t offset) {
+
+	// Step 1: You could call get_node_by_path() to get inode from path
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	int grab_node = get_node_by_path(fs, path, 0, inode_buffer);
+	if(grab_node < 0){
+		free(inode_buffer);
+		return grab_node;
+	}
+
+	// Nothing to read past the end of the file.
+	if(offset >= inode_buffer->size){
+		free(inode_buffer);
+		return 0;
+	}
+	if(offset + size > inode_buffer->size){
+		size = inode_buffer->size - offset;
+	}
+
+	// Step 2: Based on size and offset, read its data blocks from disk
+	// The offset and size will tell you which data blocks to read. Compressed chunks are decompressed once and copied out of.
+	char* block = (char*)blkbuf_get();
+	char* chunk_buf = NULL;
+	int loaded_chunk = -1;
+
+	// Fetch the plain blocks of the range up front, all at the same time through the I/O workers.
+	char* prefetch = NULL;
+	int prefetched[16];
+	memset(prefetched, -1, sizeof(prefetched));
+	if(size > 0){
+		int blks[16];
+		char* bufs[16];
+		int lblks[16];
+		int count = 0;
+		int lblk = 0;
+		for(lblk = offset / BLOCK_SIZE; lblk <= (int)((offset + size - 1) / BLOCK_SIZE); lblk++){
+			int ptr = inode_buffer->direct_ptr[lblk];
+			if(!chunk_is_packed(inode_buffer, lblk / ZCHUNK_BLKS) && ptr != -1 && !(ptr & PTR_UNWRITTEN)){
+				lblks[count] = lblk;
+				blks[count++] = ptr;
+			}
+		}
+		if(count >= 2){
+			prefetch = (char*)blkbuf_alloc(count * BLOCK_SIZE);
+			int i = 0;
+			for(i = 0; i < count; i++){
+				bufs[i] = prefetch + i * BLOCK_SIZE;
+			}
+			int good = tfs_dread_many(fs, blks, bufs, count);
+			for(i = 0; i < good; i++){
+				prefetched[lblks[i]] = i;		// the rest is read again below, and fails there if it's really bad
+			}
+		}
+	}
+
+	size_t bytes_read = 0;
+	while(bytes_read < size){
+		off_t pos = offset + bytes_read;
+		int chunk = pos / ZCHUNK_SIZE;
+		int lblk = pos / BLOCK_SIZE;
+		int blk_off = pos % BLOCK_SIZE;
+		size_t len = BLOCK_SIZE - blk_off;
+		if(len > size - bytes_read){
+			len = size - bytes_read;
+		}
+
+		// Step 3: copy the correct amount of data from offset to buffer
+		if(chunk_is_packed(inode_buffer, chunk)){
+			if(loaded_chunk != chunk){
+				if(chunk_buf == NULL){
+					chunk_buf = (char*)blkbuf_alloc(ZCHUNK_SIZE);
+				}
+				if(chunk_load(fs, inode_buffer, chunk, chunk_buf) < 0){
+					break;
+				}
+				loaded_chunk = chunk;
+			}
+			memcpy(buffer + bytes_read, chunk_buf + (pos - (off_t)chunk * ZCHUNK_SIZE), len);
+		}
+		else if(inode_buffer->direct_ptr[lblk] == -1 || (inode_buffer->direct_ptr[lblk] & PTR_UNWRITTEN)){
+			memset(buffer + bytes_read, 0, len);		// hole in the file, or preallocated and never written
+		}
+		else if(prefetched[lblk] != -1){
+			memcpy(buffer + bytes_read, prefetch + prefetched[lblk] * BLOCK_SIZE + blk_off, len);
+		}
+		else{
+			if(tfs_dread(fs, inode_buffer->direct_ptr[lblk], block) < 0){
+				break;
+			}
+			memcpy(buffer + bytes_read, block + blk_off, len);
+		}
+		bytes_read += len;
+	}
+
+	blkbuf_put(block);
+	free(prefetch);
+	free(chunk_buf);
+	if(bytes_read > 0){
+		itime_accessed(fs, inode_buffer);
+	}
+	free(inode_buffer);
+
+	// Note: this function should return the amount of bytes you copied to buffer
+	if(bytes_read == 0 && size != 0){
+		return -EIO;					// the very first block was unreadable
+	}
+	return bytes_read;
+}
+
+int libtfs_read(struct tfs_fs* fs, const char *path, char *buffer, size_t size, off_t offset) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_read_locked(fs, path, buffer, size, offset);
+	tfs_unlock(fs);
+	return ret;
+}
+
+static int libtfs_write_locked(struct tfs_fs* fs, const char *path, const char *buffer, size_t size, off_t offset) {
+
+	// Step 1: You could call get_node_by_path() to get inode from path
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	int grab_node = get_node_by_path(fs, path, 0, inode_buffer);
+	// If you can't find the file, you can't write to it.
+	if(grab_node < 0){
+		free(inode_buffer);
+		return grab_node;
+	}
+
+	// If the file is larger than the 16 blocks, then return an error.
+	off_t end_point = offset + size;				// where you're projected to end in the file
+	if(end_point > BLOCK_SIZE * 16){
+		free(inode_buffer);
+		return -EFBIG;						// file too big for file system
+	}
+	off_t new_size = (end_point > inode_buffer->size) ? end_point : inode_buffer->size;
+
+	// Step 2: Based on size and offset, work out which chunks/blocks get touched.
+	// Chunks that are (or are about to be) compressed are rewritten as a whole; plain files go block by block.
+	size_t bytes_written = 0;					// keep a running tally of how much you wrote
+	char* chunk_buf = NULL;
+	int ret = 0;
+	while(bytes_written < size){
+		off_t pos = offset + bytes_written;
+		int chunk = pos / ZCHUNK_SIZE;
+
+		// Step 3: Write the correct amount of data from offset to disk
+		if(fs->opts.compress || chunk_is_packed(inode_buffer, chunk)){
+			off_t chunk_start = (off_t)chunk * ZCHUNK_SIZE;
+			size_t len = chunk_start + ZCHUNK_SIZE - pos;
+			if(len > size - bytes_written){
+				len = size - bytes_written;
+			}
+			if(chunk_buf == NULL){
+				chunk_buf = (char*)blkbuf_alloc(ZCHUNK_SIZE);
+			}
+			ret = chunk_load(fs, inode_buffer, chunk, chunk_buf);
+			if(ret < 0){
+				break;
+			}
+			memcpy(chunk_buf + (pos - chunk_start), buffer + bytes_written, len);
+			int ulen = (new_size - chunk_start < ZCHUNK_SIZE) ? new_size - chunk_start : ZCHUNK_SIZE;
+			int dirty_first = (pos - chunk_start) / BLOCK_SIZE;
+			int dirty_last = (pos - chunk_start + len - 1) / BLOCK_SIZE;
+			ret = chunk_store(fs, inode_buffer, chunk, chunk_buf, ulen, dirty_first, dirty_last);
+			if(ret < 0){
+				break;
+			}
+			bytes_written += len;
+		}
+		else{
+			int blk_off = pos % BLOCK_SIZE;
+			size_t len = BLOCK_SIZE - blk_off;
+			if(len > size - bytes_written){
+				len = size - bytes_written;
+			}
+
+			// Anything spanning several blocks is written as one batch, up to the next compressed chunk.
+			int run = 0;
+			if(!fs->opts.dedup){
+				int lblk = pos / BLOCK_SIZE;
+				int last = (offset + size - 1) / BLOCK_SIZE;
+				while(lblk + run <= last && !chunk_is_packed(inode_buffer, (lblk + run) / ZCHUNK_BLKS)){
+					run++;
+				}
+			}
+			if(run >= 2){
+				size_t run_len = (off_t)(pos / BLOCK_SIZE + run) * BLOCK_SIZE - pos;
+				if(run_len > size - bytes_written){
+					run_len = size - bytes_written;
+				}
+				ret = file_write_run(fs, inode_buffer, pos, run_len, buffer + bytes_written);
+				if(ret < 0){
+					break;
+				}
+				bytes_written += run_len;
+				continue;
+			}
+			ret = file_write_block(fs, inode_buffer, pos / BLOCK_SIZE, buffer + bytes_written, blk_off, len);
+			if(ret < 0){
+				break;
+			}
+			bytes_written += len;
+		}
+	}
+	free(chunk_buf);
+
+	// Step 4: Update the inode info and write it to disk
+	// Substep 1: Update the relevant information. The size only grows as far as we actually got.
+	if(offset + (off_t)bytes_written > inode_buffer->size){
+		inode_buffer->size = offset + bytes_written;
+	}
+	(inode_buffer->vstat).st_size = inode_buffer->size;
+	int blks[16];
+	(inode_buffer->vstat).st_blocks = inode_blknos(inode_buffer, blks);	// keep track of the number of blocks the file really holds
+	if(bytes_written > 0){
+		(inode_buffer->vstat).st_mtim = itime_now();	// the inode is written anyway, so the times go with it
+		(inode_buffer->vstat).st_ctim = (inode_buffer->vstat).st_mtim;
+	}
+
+	// Substep 2: Write the updated inode to disk.
+	writei(fs, inode_buffer->ino, inode_buffer);
+	free(inode_buffer);
+
+	// Note: this function should return the amount of bytes you write to disk
+	if(bytes_written == 0 && ret < 0){
+		return ret;
+	}
+	return bytes_written;
+}
+
+int libtfs_write(struct tfs_fs* fs, const char *path, const char *buffer, size_t size, off_t offset) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_write_locked(fs, path, buffer, size, offset);
+	tfs_unlock(fs);
+	return ret;
+}
+
+/*
+ * Zero-copy data path. Instead of moving file data through our own buffers, these hand out the places in the
+ * disk file where a range of the file lives, so the caller can move the bytes itself (tfs.c lets FUSE splice
+ * them between /dev/fuse and the disk file). That only works when nothing has to look at the data on the way:
+ * no checksums, no compression, no dedup, and no O_DIRECT (splicing goes through the page cache).
+ */
+static int extents_allowed(struct tfs_fs* fs, const struct inode* inode, off_t offset, size_t size) {
+	if(fs->opts.csum_data || fs->opts.compress || fs->opts.dedup || fs->opts.direct_io){
+		return 0;
+	}
+	if(inode->type != 0 || size == 0 || offset + size > BLOCK_SIZE * 16){
+		return 0;
+	}
+	int chunk = 0;
+	for(chunk = offset / ZCHUNK_SIZE; chunk <= (int)((offset + size - 1) / ZCHUNK_SIZE); chunk++){
+		if(chunk_is_packed(inode, chunk)){
+			return 0;				// compressed data has to be decompressed by us
+		}
+	}
+	return 1;
+}
+
+/*
+ * Add [pos, pos + len) of the disk file (fd == -1 for zeroes) to ext, merging it into the last extent if they touch.
+ */
+static int extent_append(struct libtfs_extent* ext, int count, int fd, off_t pos, size_t len) {
+	if(count > 0 && ext[count - 1].fd == fd && (fd == -1 || ext[count - 1].pos + (off_t)ext[count - 1].len == pos)){
+		ext[count - 1].len += len;
+		return count;
+	}
+	ext[count].fd = fd;
+	ext[count].pos = pos;
+	ext[count].len = len;
+	return count + 1;
+}
+
+static int libtfs_read_extents_locked(struct tfs_fs* fs, const char *path, off_t offset, size_t size, struct libtfs_extent* ext) {
+
+	// Step 1: Get the inode and clip the range to the end of the file
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	int found = get_node_by_path(fs, path, 0, inode_buffer);
+	if(found < 0){
+		free(inode_buffer);
+		return found;
+	}
+	if(offset >= inode_buffer->size){
+		free(inode_buffer);
+		return 0;
+	}
+	if(offset + size > inode_buffer->size){
+		size = inode_buffer->size - offset;
+	}
+	if(!extents_allowed(fs, inode_buffer, offset, size)){
+		free(inode_buffer);
+		return -ENOTSUP;
+	}
+
+	// Step 2: Map every block the range touches, neighbouring blocks on disk become one extent
+	int count = 0;
+	size_t mapped = 0;
+	while(mapped < size){
+		off_t pos = offset + mapped;
+		int lblk = pos / BLOCK_SIZE;
+		int blk_off = pos % BLOCK_SIZE;
+		size_t len = BLOCK_SIZE - blk_off;
+		if(len > size - mapped){
+			len = size - mapped;
+		}
+		int ptr = inode_buffer->direct_ptr[lblk];
+		if(ptr == -1 || (ptr & PTR_UNWRITTEN)){
+			count = extent_append(ext, count, -1, 0, len);		// hole in the file, or preallocated and never written
+		}
+		else{
+			off_t dev_pos = 0;
+			int fd = dev_map(fs, ptr, &dev_pos);
+			count = extent_append(ext, count, fd, dev_pos + blk_off, len);
+		}
+		mapped += len;
+	}
+
+	// The caller reads the blocks after we let go of fs->lock, they mustn't go to another file right away if they're freed.
+	if(fs->reuse_at == NULL){
+		fs->reuse_at = (time_t*)calloc(TFS_NBLOCKS, sizeof(time_t));
+	}
+	fs->extents_at = time(NULL);
+
+	itime_accessed(fs, inode_buffer);		// the caller reads the data, the access is ours to record
+	free(inode_buffer);
+	return count;
+}
+
+int libtfs_read_extents(struct tfs_fs* fs, const char *path, off_t offset, size_t size, struct libtfs_extent* ext) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_read_extents_locked(fs, path, offset, size, ext);
+	tfs_unlock(fs);
+	return ret;
+}
+
+static int libtfs_write_extents_locked(struct tfs_fs* fs, const char *path, off_t offset, size_t size, libtfs_copy_t copy, void *ctx) {
+
+	// Step 1: Get the inode. Only whole blocks, so no block has to be read and merged first.
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	int found = get_node_by_path(fs, path, 0, inode_buffer);
+	if(found < 0){
+		free(inode_buffer);
+		return found;
+	}
+	if(offset % BLOCK_SIZE != 0 || size % BLOCK_SIZE != 0 || !extents_allowed(fs, inode_buffer, offset, size)){
+		free(inode_buffer);
+		return -ENOTSUP;
+	}
+
+	// Step 2: Find a block for every logical block in the range. Holes and blocks shared with a clone get a new one.
+	int first = offset / BLOCK_SIZE;
+	int nblk = size / BLOCK_SIZE;
+	int new_ptrs[16];
+	int fresh_blks[16];
+	int n_fresh = 0;
+	int cow_blks[16];
+	int n_cow = 0;
+	int i = 0;
+	for(i = 0; i < nblk; i++){
+		int ptr = inode_buffer->direct_ptr[first + i];
+		if(ptr != -1){
+			ptr = PTR_BLK(ptr);				// whole blocks, so a preallocated one just starts holding data
+		}
+		if(ptr == -1 || blk_shared(fs, ptr)){
+			ptr = (i > 0) ? get_avail_blkno(fs, new_ptrs[i - 1] + 1) : get_avail_blkno(fs, blk_goal(fs, inode_buffer, first));
+			if(ptr == -1){
+				release_blknos(fs, fresh_blks, n_fresh);
+				free(inode_buffer);
+				return -ENOSPC;
+			}
+			if(inode_buffer->direct_ptr[first + i] != -1){
+				cow_blks[n_cow++] = PTR_BLK(inode_buffer->direct_ptr[first + i]);
+			}
+			fresh_blks[n_fresh++] = ptr;
+		}
+		else{
+			dedup_forget(fs, ptr);			// overwritten in place, its old content is gone
+		}
+		new_ptrs[i] = ptr;
+	}
+
+	// Step 3: Let the caller move the data straight into those blocks
+	struct libtfs_extent ext[16];
+	int count = 0;
+	for(i = 0; i < nblk; i++){
+		off_t dev_pos = 0;
+		int fd = dev_map(fs, new_ptrs[i], &dev_pos);
+		count = extent_append(ext, count, fd, dev_pos, BLOCK_SIZE);
+	}
+	ssize_t copied = copy(ctx, ext, count);
+	if(copied != (ssize_t)size){
+		release_blknos(fs, fresh_blks, n_fresh);
+		free(inode_buffer);
+		return (copied < 0) ? copied : -EIO;
+	}
+
+	// Step 4: Same as tfs_dwrite() without csum_data, any old checksum for these blocks is stale now
+	for(i = 0; i < nblk; i++){
+		if(csum_covers(fs, new_ptrs[i])){
+			csum_store(fs, new_ptrs[i], 0);
+		}
+	}
+
+	// Step 5: Point the inode at the blocks, let go of the shared copies, and write it back
+	memcpy(&inode_buffer->direct_ptr[first], new_ptrs, nblk * sizeof(int));
+	release_blknos(fs, cow_blks, n_cow);
+	if(offset + (off_t)size > inode_buffer->size){
+		inode_buffer->size = offset + size;
+	}
+	(inode_buffer->vstat).st_size = inode_buffer->size;
+	int blks[16];
+	(inode_buffer->vstat).st_blocks = inode_blknos(inode_buffer, blks);
+	(inode_buffer->vstat).st_mtim = itime_now();
+	(inode_buffer->vstat).st_ctim = (inode_buffer->vstat).st_mtim;
+	writei(fs, inode_buffer->ino, inode_buffer);
+	free(inode_buffer);
+	return size;
+}
+
+int libtfs_write_extents(struct tfs_fs* fs, const char *path, off_t offset, size_t size, libtfs_copy_t copy, void *ctx) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_write_extents_locked(fs, path, offset, size, copy, ctx);
+	tfs_unlock(fs);
+	return ret;
+}
+
+/*
+ * Zero [offset, offset + len) of a file and give back the blocks that lie entirely inside it (FALLOC_FL_PUNCH_HOLE).
+ * Compressed chunks are rewritten with the range zeroed, partly covered raw blocks get zeroes written into them,
+ * and everything else is collected and released with one bitmap update per group.
+ */
+static int punch_hole(struct tfs_fs* fs, struct inode* inode, off_t offset, off_t len) {
+	off_t end = offset + len;			// can go past the end of the file, preallocated blocks there go too
+	int freed[16];
+	int n_freed = 0;
+	char* chunk_buf = NULL;
+	char* zeroes = (char*)blkbuf_zalloc(BLOCK_SIZE);
+	int ret = 0;
+	off_t pos = offset;
+	while(pos < end && ret == 0){
+		int chunk = pos / ZCHUNK_SIZE;
+		off_t chunk_start = (off_t)chunk * ZCHUNK_SIZE;
+		off_t chunk_end = (chunk_start + ZCHUNK_SIZE < end) ? chunk_start + ZCHUNK_SIZE : end;
+
+		// A compressed chunk is loaded, zeroed and stored again as a whole.
+		if(chunk_is_packed(inode, chunk) && chunk_start < inode->size){
+			if(chunk_buf == NULL){
+				chunk_buf = (char*)blkbuf_alloc(ZCHUNK_SIZE);
+			}
+			ret = chunk_load(fs, inode, chunk, chunk_buf);
+			if(ret == 0){
+				memset(chunk_buf + (pos - chunk_start), 0, chunk_end - pos);
+				int ulen = (inode->size - chunk_start < ZCHUNK_SIZE) ? inode->size - chunk_start : ZCHUNK_SIZE;
+				ret = chunk_store(fs, inode, chunk, chunk_buf, ulen, 0, ZCHUNK_BLKS - 1);
+			}
+			pos = chunk_end;
+			continue;
+		}
+
+		// Raw blocks: whole ones are dropped, the edges get zeroes (unless they're holes already).
+		int lblk = pos / BLOCK_SIZE;
+		int blk_off = pos % BLOCK_SIZE;
+		off_t blk_end = ((off_t)lblk + 1) * BLOCK_SIZE;
+		int piece = ((blk_end < end) ? blk_end : end) - pos;
+		int ptr = inode->direct_ptr[lblk];
+		if(ptr != -1 && piece == BLOCK_SIZE){
+			freed[n_freed++] = PTR_BLK(ptr);
+			inode->direct_ptr[lblk] = -1;
+		}
+		else if(ptr != -1 && !(ptr & PTR_UNWRITTEN)){
+			ret = file_write_block(fs, inode, lblk, zeroes, blk_off, piece);
+		}
+		pos += piece;
+	}
+	release_blknos(fs, freed, n_freed);
+	free(zeroes);
+	free(chunk_buf);
+	return ret;
+}
+
+/*
+ * Preallocate or punch out part of a regular file, like fallocate(2). Without flags (or with FALLOC_FL_KEEP_SIZE)
+ * every hole in the range gets a block, all of them taken in one pass over the bitmap and as one contiguous run if
+ * there is one. They're marked PTR_UNWRITTEN, so they read back as zeroes until something is written into them.
+ * FALLOC_FL_PUNCH_HOLE (always together with FALLOC_FL_KEEP_SIZE) frees the range instead.
+ */
+static int libtfs_fallocate_locked(struct tfs_fs* fs, const char *path, int mode, off_t offset, off_t len) {
+	if(offset < 0 || len <= 0){
+		return -EINVAL;
+	}
+	if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)){
+		return -EOPNOTSUPP;				// no zero-range, collapse or insert
+	}
+	if((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)){
+		return -EOPNOTSUPP;				// same rule as Linux
+	}
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode* inode_buffer = (struct inode*)malloc(sizeof(struct inode));
+	int found = get_node_by_path(fs, path, 0, inode_buffer);
+	if(found < 0){
+		free(inode_buffer);
+		return found;
+	}
+	if(inode_buffer->type != 0){
+		free(inode_buffer);
+		return -EISDIR;
+	}
+	if(offset + len > BLOCK_SIZE * 16 && !(mode & FALLOC_FL_PUNCH_HOLE)){
+		free(inode_buffer);
+		return -EFBIG;					// files are at most 16 blocks
+	}
+
+	int ret = 0;
+	if(mode & FALLOC_FL_PUNCH_HOLE){
+		// Step 2a: Free the range
+		ret = punch_hole(fs, inode_buffer, offset, (offset + len > BLOCK_SIZE * 16) ? BLOCK_SIZE * 16 - offset : len);
+	}
+	else{
+		// Step 2b: Find the holes in the range. Compressed chunks already cover their whole range.
+		int want[16];
+		int n_want = 0;
+		int lblk = 0;
+		for(lblk = offset / BLOCK_SIZE; lblk <= (offset + len - 1) / BLOCK_SIZE; lblk++){
+			if(inode_buffer->direct_ptr[lblk] == -1 && !chunk_is_packed(inode_buffer, lblk / ZCHUNK_BLKS)){
+				want[n_want++] = lblk;
+			}
+		}
+
+		// Step 3b: Reserve all of them at once, or none
+		int blks[16];
+		if(n_want > 0){
+			int got = get_avail_run(fs, blk_goal(fs, inode_buffer, want[0]), n_want, blks);
+			if(got < n_want){
+				release_blknos(fs, blks, got);
+				free(inode_buffer);
+				return -ENOSPC;
+			}
+		}
+		int i = 0;
+		for(i = 0; i < n_want; i++){
+			inode_buffer->direct_ptr[want[i]] = blks[i] | PTR_UNWRITTEN;
+		}
+		if(!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode_buffer->size){
+			inode_buffer->size = offset + len;
+		}
+	}
+
+	// Step 4: Update the inode and write it to disk
+	(inode_buffer->vstat).st_size = inode_buffer->size;
+	int blks[16];
+	(inode_buffer->vstat).st_blocks = inode_blknos(inode_buffer, blks);
+	(inode_buffer->vstat).st_mtim = itime_now();
+	(inode_buffer->vstat).st_ctim = (inode_buffer->vstat).st_mtim;
+	writei(fs, inode_buffer->ino, inode_buffer);
+	free(inode_buffer);
+	return ret;
+}
+
+int libtfs_fallocate(struct tfs_fs* fs, const char *path, int mode, off_t offset, off_t len) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_fallocate_locked(fs, path, mode, offset, len);
+	tfs_unlock(fs);
+	return ret;
+}
+
+static int libtfs_unlink_locked(struct tfs_fs* fs, const char *path) {
+	return remove_node(fs, path, 0);
+}
+
+int libtfs_unlink(struct tfs_fs* fs, const char *path) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_unlink_locked(fs, path);
+	tfs_unlock(fs);
+	return ret;
+}
+
+/*
+ * Move a directory entry, possibly to another directory and possibly over an existing one.
+ * Only directory entries change: the inode and its data blocks stay exactly where they are.
+ */
+static int rename_entry(struct tfs_fs* fs, struct inode* src_parent, struct inode* dest_parent, const char *from_name, const char *to_name) {
+	struct dirent src_entry;
+	struct dirent dest_entry;
+	struct inode src_inode;
+	struct inode dest_inode;
+
+	if(src_parent->type != 1 || dest_parent->type != 1){
+		return -ENOTDIR;				// a path that goes through a regular file
+	}
+	if(strlen(to_name) >= sizeof(((struct dirent*)0)->name)){
+		return -ENAMETOOLONG;				// doesn't fit in a directory entry
+	}
+	if(dir_find(fs, src_parent->ino, from_name, strlen(from_name), &src_entry) == -1 || readi(fs, src_entry.ino, &src_inode) == -1){
+		return -ENOENT;
+	}
+
+	// Step 3: If the target name exists, it gets replaced (as long as the types line up)
+	if(dir_find(fs, dest_parent->ino, to_name, strlen(to_name), &dest_entry) == 0){
+		if(dest_entry.ino == src_entry.ino){
+			return 0;					// renaming something onto itself does nothing
+		}
+		readi(fs, dest_entry.ino, &dest_inode);
+		if(dest_inode.type == 1 && src_inode.type != 1){
+			return -EISDIR;
+		}
+		if(dest_inode.type != 1 && src_inode.type == 1){
+			return -ENOTDIR;
+		}
+		if(dest_inode.type == 1 && !dir_is_empty(fs, dest_inode)){
+			return -ENOTEMPTY;
+		}
+
+		// Swing the target entry over to our inode (one block write, so the name never goes missing), then drop the old name.
+		if(dir_replace(fs, *dest_parent, to_name, strlen(to_name), src_entry.ino, to_name) == -1){
+			return -EIO;
+		}
+		if(dir_remove(fs, *src_parent, from_name, strlen(from_name)) == -1){
+			dir_replace(fs, *dest_parent, to_name, strlen(to_name), dest_inode.ino, to_name);	// the target is still ours then
+			return -EIO;
+		}
+
+		// The replaced inode is gone now, give back its blocks and inode number.
+		int owned_blks[16];
+		release_blknos(fs, owned_blks, inode_blknos(&dest_inode, owned_blks));
+		free_ino(fs, dest_inode.ino);
+	}
+
+	// Step 4: Same directory, just rename the entry in place
+	else if(src_parent->ino == dest_parent->ino){
+		if(dir_replace(fs, *src_parent, from_name, strlen(from_name), src_entry.ino, to_name) == -1){
+			return -ENOENT;
+		}
+	}
+
+	// Step 5: Different directory, add the new entry first so a crash in between leaves two names rather than none
+	else{
+		if(dir_add(fs, dest_parent, src_entry.ino, to_name, strlen(to_name)) == -1){
+			return -ENOSPC;
+		}
+		if(dir_remove(fs, *src_parent, from_name, strlen(from_name)) == -1){
+			dir_remove(fs, *dest_parent, to_name, strlen(to_name));
+			return -EIO;
+		}
+	}
+
+	// Step 6: Both directories changed, and so did the inode that moved (its ctime, not its data)
+	itime_touch(fs, src_parent, ITIME_MTIME | ITIME_CTIME);
+	itime_touch(fs, dest_parent, ITIME_MTIME | ITIME_CTIME);
+	itime_touch(fs, &src_inode, ITIME_CTIME);
+	return 0;
+}
+
+static int libtfs_rename_locked(struct tfs_fs* fs, const char *from, const char *to) {
+
+	// Step 1: Split both paths into parent directory and name
+	char from_parent[252];
+	char from_name[252];
+	char to_parent[252];
+	char to_name[252];
+	if(split_path(from, from_parent, from_name) == -1 || split_path(to, to_parent, to_name) == -1){
+		return -ENAMETOOLONG;
+	}
+
+	// A directory can't be moved underneath itself.
+	int from_len = strlen(from);
+	if(strncmp(to, from, from_len) == 0 && to[from_len] == '/'){
+		return -EINVAL;
+	}
+
+	// Step 2: Look up both parent directories, then move the entry
+	struct inode* src_parent = (struct inode*)malloc(sizeof(struct inode));
+	struct inode* dest_parent = (struct inode*)malloc(sizeof(struct inode));
+	int ret = get_node_by_path(fs, from_parent, 0, src_parent);
+	if(ret == 0){
+		ret = get_node_by_path(fs, to_parent, 0, dest_parent);
+	}
+	if(ret == 0){
+		ret = rename_entry(fs, src_parent, dest_parent, from_name, to_name);
+	}
+
+	free(src_parent);
+	free(dest_parent);
+	return ret;
+}
+
+int libtfs_rename(struct tfs_fs* fs, const char *from, const char *to) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_rename_locked(fs, from, to);
+	tfs_unlock(fs);
+	return ret;
+}
+
+/*
+ * Clone a regular file. The new inode points at the very same data blocks, which each pick up a reference,
+ * so this costs a directory entry and an inode no matter how big the file is. Whichever file is written
+ * to later gets its own copy of the blocks it touches (see file_write_block() and chunk_store()).
+ */
+static int libtfs_clone_locked(struct tfs_fs* fs, const char *src_path, const char *dest_path) {
+
+	// Images made before the reference count area existed can't share blocks.
+	if(fs->ref_table == NULL){
+		return -EOPNOTSUPP;
+	}
+
+	// Step 1: Call get_node_by_path() to get the inode of the source file
+	struct inode* src_inode = (struct inode*)malloc(sizeof(struct inode));
+	int found = get_node_by_path(fs, src_path, 0, src_inode);
+	if(found < 0){
+		free(src_inode);
+		return found;
+	}
+	if(src_inode->type != 0){
+		free(src_inode);
+		return -EISDIR;				// only regular files share blocks
+	}
+
+	// Step 2: Make sure every block can take one more reference
+	int blks[16];
+	int nblk = inode_blknos(src_inode, blks);
+	int i = 0;
+	for(i = 0; i < nblk; i++){
+		if(fs->ref_table[blks[i]] >= REF_MAX){
+			free(src_inode);
+			return -EMLINK;
+		}
+	}
+
+	// Step 3: The destination's parent has to be a directory that doesn't have the name yet, same as make_node()
+	char parent_name[252];
+	char child_name[252];
+	if(split_path(dest_path, parent_name, child_name) == -1 || strlen(child_name) >= sizeof(((struct dirent*)0)->name)){
+		free(src_inode);
+		return -ENAMETOOLONG;
+	}
+	if(child_name[0] == '\0'){
+		free(src_inode);
+		return -EEXIST;				// "/" itself
+	}
+	struct inode* parent_inode = (struct inode*)malloc(sizeof(struct inode));
+	struct dirent entry;
+	found = get_node_by_path(fs, parent_name, 0, parent_inode);
+	if(found == 0 && parent_inode->type != 1){
+		found = -ENOTDIR;
+	}
+	if(found == 0 && dir_find(fs, parent_inode->ino, child_name, strlen(child_name), &entry) == 0){
+		found = -EEXIST;
+	}
+	if(found < 0){
+		free(src_inode);
+		free(parent_inode);
+		return found;
+	}
+
+	// Step 4: Get an inode number for the clone and link it into the parent
+	int clone_ino = get_avail_ino(fs, parent_inode->ino, 0);
+	if(clone_ino == -1){
+		free(src_inode);
+		free(parent_inode);
+		return -ENOSPC;
+	}
+	if(dir_add(fs, parent_inode, clone_ino, child_name, strlen(child_name)) == -1){
+		// The directory is full, give the inode number back.
+		free_ino(fs, clone_ino);
+		free(src_inode);
+		free(parent_inode);
+		return -ENOSPC;
+	}
+
+	// Step 5: Take the references, then write the new inode (a copy of the source with its own number)
+	for(i = 0; i < nblk; i++){
+		fs->ref_table[blks[i]]++;
+	}
+	ref_flush(fs, blks, nblk);
+
+	src_inode->ino = clone_ino;
+	src_inode->link = 1;
+	(src_inode->vstat).st_ino = clone_ino;
+	(src_inode->vstat).st_atim = itime_now();		// a new file as far as its times go
+	(src_inode->vstat).st_mtim = (src_inode->vstat).st_atim;
+	(src_inode->vstat).st_ctim = (src_inode->vstat).st_atim;
+	writei(fs, clone_ino, src_inode);
+	itime_touch(fs, parent_inode, ITIME_MTIME | ITIME_CTIME);
+
+	free(src_inode);
+	free(parent_inode);
+	return 0;
+}
+
+int libtfs_clone(struct tfs_fs* fs, const char *src_path, const char *dest_path) {
+	pthread_mutex_lock(&fs->lock);
+	int ret = libtfs_clone_locked(fs, src_path, dest_path);
+	tfs_unlock(fs);
+	return ret;
+}
+
@@ -0,0 +1,144 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	libtfs.h
+ *  Author: Yujie REN
+ *	Date:	April 2019
+ *
+ *	In-process interface to the file system. Every call takes the handle returned by libtfs_mount()
+ *	and an absolute path inside the image, and returns 0 (or a byte count) on success and a negative
+ *	errno value on failure, just like the FUSE callbacks in tfs.c that sit on top of it.
+ *	Calls on one handle are serialized by a lock inside it, so a handle can be shared between threads.
+ *
+ */
+
+#ifndef _LIBTFS_H
+#define _LIBTFS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Mount options (tfs.c fills these in from -o).
+struct tfs_options {
+	int	csum_data;		// also checksum regular file data blocks, not just metadata
+	int	compress;		// store file data as LZ4-compressed chunks when that saves blocks
+	int	dedup;			// share identical full data blocks instead of writing them again
+	int	direct_io;		// open the disk file with O_DIRECT and bypass the host page cache
+	int	sparse;			// punch freed data blocks out of the disk file so the host gets the space back
+	char*	stripes;		// more backing files, ':'-separated, to stripe the image over together with the disk file
+	int	stripe_unit;		// blocks per stripe unit when formatting a striped image (0 for the default)
+	char*	meta;			// separate backing file for the superblock, bitmaps, inode table and directories
+	int	defrag;			// run the maintenance thread (directory compaction, file defragmentation)
+	int	defrag_rate;		// blocks per second it may rewrite (0 for the default)
+	int	commit_sync;		// fdatasync() the backing files around every journal commit, so commits survive a power cut
+};
+
+// Counters kept for the life of a handle.
+struct tfs_stats {
+	unsigned long	csum_verified;		// blocks whose checksum was checked on the way in
+	unsigned long	csum_errors;		// blocks that came back different from what we wrote
+	unsigned long	zchunks_packed;		// chunks written compressed
+	unsigned long	zchunks_raw;		// chunks that didn't compress well enough and went out raw
+	unsigned long	zblocks_saved;		// data blocks those compressed chunks didn't need
+	unsigned long	dedup_hits;		// block writes that found an identical block and shared it
+	unsigned long	dedup_misses;		// block writes that had to go to disk
+	unsigned long	dedup_collisions;	// index hits whose content turned out to be different
+	unsigned long	discarded_blocks;	// freed blocks punched out of the disk file
+	unsigned long	discard_calls;		// fallocate() calls that took to do it
+	unsigned long	maint_passes;		// maintenance passes over all inodes
+	unsigned long	dirs_compacted;		// directories rewritten without their dead entries
+	unsigned long	dirents_dropped;	// dead entries those dropped
+	unsigned long	dir_blocks_freed;	// directory blocks that became empty and were freed
+	unsigned long	files_defragged;	// files moved into one contiguous run
+	unsigned long	blocks_moved;		// data blocks those took
+	unsigned long	bloom_checks;		// directory lookups that asked the directory's Bloom filter first
+	unsigned long	bloom_negatives;	// ...and were answered "not there" without reading a directory block
+	unsigned long	bloom_false_positives;	// ...or were told "maybe", and the name wasn't there after all
+	unsigned long	bloom_rebuilds;		// filters built again from the directory blocks
+	unsigned long	dev_reads;		// blocks read from the backing files, for I/O budgets per operation
+	unsigned long	dev_writes;		// blocks written to them
+	unsigned long	dev_writes_dropped;	// of those, writes libtfs_set_fault() threw away
+	unsigned long	dev_flushes;		// write barriers (commit_sync)
+	unsigned long	journal_commits;	// calls whose metadata changes went through the journal
+	unsigned long	journal_blocks;		// metadata blocks those wrote (each one twice, to the journal and home)
+};
+
+// Faults to inject under a handle's block writes (libtfs_set_fault()), for crash testing.
+struct tfs_fault {
+	long		crash_after;		// let this many writes through, then crash: every later write is dropped (-1: never)
+	int		reorder;		// at the crash, also take back a random subset of the last reorder writes (at most 64)
+	unsigned	drop_ppm;		// before the crash, drop this many writes in a million at random
+	unsigned	seed;			// for the random choices, so a failing run can be repeated
+};
+
+struct tfs_fs;
+
+// Same shape as FUSE's fuse_fill_dir_t, so tfs.c can pass its filler straight through.
+typedef int (*libtfs_filldir_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
+
+// Open the image in diskfile_path, formatting it first if it doesn't exist or isn't a tfs image. NULL on failure.
+struct tfs_fs* libtfs_mount(const char *diskfile_path, const struct tfs_options *opts);
+// Write back everything that is still only in memory, then close the image and free the handle.
+void libtfs_unmount(struct tfs_fs *fs);
+// Write back everything that is still only in memory.
+int libtfs_sync(struct tfs_fs *fs);
+
+int libtfs_getattr(struct tfs_fs *fs, const char *path, struct stat *stbuf);
+int libtfs_open(struct tfs_fs *fs, const char *path);
+int libtfs_readdir(struct tfs_fs *fs, const char *path, void *buf, libtfs_filldir_t filler);
+int libtfs_mkdir(struct tfs_fs *fs, const char *path, mode_t mode);
+int libtfs_rmdir(struct tfs_fs *fs, const char *path);
+int libtfs_create(struct tfs_fs *fs, const char *path, mode_t mode);
+int libtfs_unlink(struct tfs_fs *fs, const char *path);
+int libtfs_rename(struct tfs_fs *fs, const char *from, const char *to);
+int libtfs_read(struct tfs_fs *fs, const char *path, char *buffer, size_t size, off_t offset);
+int libtfs_write(struct tfs_fs *fs, const char *path, const char *buffer, size_t size, off_t offset);
+int libtfs_clone(struct tfs_fs *fs, const char *src_path, const char *dest_path);
+// Same as utimensat(): tv[0] is atime, tv[1] is mtime, NULL sets both to now.
+int libtfs_utimens(struct tfs_fs *fs, const char *path, const struct timespec tv[2]);
+// Same as fallocate(2), mode is 0 or FALLOC_FL_KEEP_SIZE, optionally with FALLOC_FL_PUNCH_HOLE.
+int libtfs_fallocate(struct tfs_fs *fs, const char *path, int mode, off_t offset, off_t len);
+// One maintenance pass over the whole image right now, without the defrag_rate limit. Works with or without
+// the defrag option, returns the number of directories compacted plus files defragmented.
+int libtfs_defrag(struct tfs_fs *fs);
+
+// Testing hooks. libtfs_set_fault() starts injecting faults (NULL stops it), counting from the next write.
+// Dropped writes still report success. Once the handle has crashed, unmount it and mount the image again.
+int libtfs_set_fault(struct tfs_fs *fs, const struct tfs_fault *fault);
+// Has the handle crashed yet, i.e. has a write come after the first crash_after?
+int libtfs_crashed(struct tfs_fs *fs);
+// Check the image like fsck: allocated inodes, directory entries, data bitmaps and reference counts. Prints
+// every problem to out (unless it's NULL) and returns how many there were, or -ENOMEM.
+int libtfs_check(struct tfs_fs *fs, FILE *out);
+
+// A piece of a file's data inside the disk file, for callers that move the bytes themselves.
+#define LIBTFS_MAX_EXTENTS	16			// a file has at most 16 data blocks
+
+struct libtfs_extent {
+	int	fd;		// descriptor on the disk file, -1 for a hole (reads as zeroes)
+	off_t	pos;		// byte offset in the disk file
+	size_t	len;
+};
+
+// Moves the data for ext[0..count) into place, returns the number of bytes it moved or a negative errno value.
+typedef ssize_t (*libtfs_copy_t)(void *ctx, const struct libtfs_extent *ext, int count);
+
+// Where [offset, offset + size) of a file lives, clipped to the end of the file. Fills in up to LIBTFS_MAX_EXTENTS
+// extents and returns how many, or -ENOTSUP when the data has to go through libtfs_read() (checksums, compression...).
+// Blocks freed in the next couple of seconds aren't given to other files, so the extents stay good for a splice.
+int libtfs_read_extents(struct tfs_fs *fs, const char *path, off_t offset, size_t size, struct libtfs_extent *ext);
+// Block-aligned write where copy() puts the data straight into the blocks we picked. Returns size,
+// or -ENOTSUP when the data has to go through libtfs_write() instead.
+int libtfs_write_extents(struct tfs_fs *fs, const char *path, off_t offset, size_t size, libtfs_copy_t copy, void *ctx);
+
+const struct tfs_stats* libtfs_get_stats(struct tfs_fs *fs);
+// Print the counters that matter for the options this handle was mounted with.
+void libtfs_report(struct tfs_fs *fs, FILE *out);
+// Time the checksum kernels this CPU supports and print the results ("tfs --bench-csum").
+int libtfs_bench_csum();
+
+#endif
@@ -0,0 +1,374 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	tfs_replay.c
+ *  Author: Yujie REN
+ *	Date:	April 2019
+ *
+ *	Replays a trace recorded with "tfs -o trace=FILE" against a fresh image through libtfs, and prints
+ *	latency percentiles for every kind of operation next to the ones that were recorded.
+ *
+ *	Build:	gcc -o tfs_replay tfs_replay.c libtfs.o -lpthread
+ *	Usage:	tfs_replay [-p] [-o csum_data,compress,dedup,odirect,sparse,commit_sync] TRACE IMAGE
+ *
+ *	-p keeps the original pacing (waits until each operation's recorded start time), otherwise operations
+ *	run back to back. -o replaces the options the trace was recorded with. IMAGE must not exist yet.
+ *	Traces don't keep file contents, writes replay a fixed pattern of the recorded size.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "libtfs.h"
+#include "tfs_trace.h"
+
+static const char* op_names[TFS_OP_MAX] = {
+	[TFS_OP_GETATTR] = "getattr",
+	[TFS_OP_OPEN] = "open",
+	[TFS_OP_READDIR] = "readdir",
+	[TFS_OP_MKDIR] = "mkdir",
+	[TFS_OP_RMDIR] = "rmdir",
+	[TFS_OP_CREATE] = "create",
+	[TFS_OP_UNLINK] = "unlink",
+	[TFS_OP_RENAME] = "rename",
+	[TFS_OP_READ] = "read",
+	[TFS_OP_WRITE] = "write",
+	[TFS_OP_FLUSH] = "flush",
+	[TFS_OP_UTIMENS] = "utimens",
+	[TFS_OP_CLONE] = "clone",
+	[TFS_OP_FALLOCATE] = "fallocate",
+	[TFS_OP_OPENDIR] = "opendir",
+	[TFS_OP_DEFRAG] = "defrag",
+};
+
+// One record read from the trace, with its paths turned into strings.
+struct replay_op {
+	struct tfs_trace_rec	rec;
+	char*			path;
+	char*			path2;
+};
+
+// Latencies of one kind of operation.
+struct op_stats {
+	int		count;
+	int		mismatches;		// returned something different from the recording
+	uint64_t*	orig_ns;
+	uint64_t*	replay_ns;
+};
+
+static uint64_t now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static int count_entries(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	(*(int*)buf)++;
+	return 0;
+}
+
+/*
+ * Read the whole trace into memory, so reading it doesn't end up in the timings. Returns the number of records.
+ */
+static int load_trace(const char *trace_path, struct tfs_trace_header* header, struct replay_op** ops_out) {
+	FILE* trace = fopen(trace_path, "rb");
+	if(trace == NULL){
+		fprintf(stderr, "tfs_replay: can't open %s (%s)\n", trace_path, strerror(errno));
+		return -1;
+	}
+	if(fread(header, sizeof(*header), 1, trace) != 1 || memcmp(header->magic, TFS_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+	   header->version != TFS_TRACE_VERSION){
+		fprintf(stderr, "tfs_replay: %s isn't a tfs trace\n", trace_path);
+		fclose(trace);
+		return -1;
+	}
+
+	int count = 0;
+	int cap = 1024;
+	struct replay_op* ops = (struct replay_op*)malloc(cap * sizeof(struct replay_op));
+	struct tfs_trace_rec rec;
+	while(fread(&rec, sizeof(rec), 1, trace) == 1){
+		if(rec.op == 0 || rec.op >= TFS_OP_MAX){
+			fprintf(stderr, "tfs_replay: bad record %d, stopping there\n", count);
+			break;
+		}
+		if(count == cap){
+			cap *= 2;
+			ops = (struct replay_op*)realloc(ops, cap * sizeof(struct replay_op));
+		}
+		ops[count].rec = rec;
+		ops[count].path = (char*)calloc(1, rec.path_len + 1);
+		ops[count].path2 = (char*)calloc(1, rec.path2_len + 1);
+		if(fread(ops[count].path, 1, rec.path_len, trace) != rec.path_len ||
+		   fread(ops[count].path2, 1, rec.path2_len, trace) != rec.path2_len){
+			fprintf(stderr, "tfs_replay: trace ends in the middle of record %d\n", count);
+			free(ops[count].path);
+			free(ops[count].path2);
+			break;
+		}
+		count++;
+	}
+
+	fclose(trace);
+	*ops_out = ops;
+	return count;
+}
+
+/*
+ * Run one operation against fs, the same way tfs.c would have called libtfs for it.
+ */
+static int replay_one(struct tfs_fs* fs, const struct replay_op* op, char* data) {
+	const struct tfs_trace_rec* rec = &op->rec;
+	int entries = 0;
+	struct stat st;
+	struct timespec tv[2];
+
+	switch(rec->op){
+	case TFS_OP_GETATTR:
+		return libtfs_getattr(fs, op->path, &st);
+	case TFS_OP_OPEN:
+		return libtfs_open(fs, op->path);
+	case TFS_OP_READDIR:
+		return libtfs_readdir(fs, op->path, &entries, count_entries);
+	case TFS_OP_MKDIR:
+		return libtfs_mkdir(fs, op->path, rec->mode);
+	case TFS_OP_RMDIR:
+		return libtfs_rmdir(fs, op->path);
+	case TFS_OP_CREATE:
+		return libtfs_create(fs, op->path, rec->mode);
+	case TFS_OP_UNLINK:
+		return libtfs_unlink(fs, op->path);
+	case TFS_OP_RENAME:
+		return libtfs_rename(fs, op->path, op->path2);
+	case TFS_OP_READ:
+		return libtfs_read(fs, op->path, data, rec->size, rec->offset);
+	case TFS_OP_WRITE:
+		return libtfs_write(fs, op->path, data, rec->size, rec->offset);
+	case TFS_OP_FLUSH:
+		return libtfs_sync(fs);
+	case TFS_OP_UTIMENS:
+		tv[0].tv_sec = TFS_TRACE_SEC(rec->offset);
+		tv[0].tv_nsec = TFS_TRACE_NSEC(rec->offset);
+		tv[1].tv_sec = TFS_TRACE_SEC(rec->size);
+		tv[1].tv_nsec = TFS_TRACE_NSEC(rec->size);
+		return libtfs_utimens(fs, op->path, tv);
+	case TFS_OP_CLONE:
+		return libtfs_clone(fs, op->path, op->path2);
+	case TFS_OP_FALLOCATE:
+		return libtfs_fallocate(fs, op->path, rec->mode, rec->offset, rec->size);
+	case TFS_OP_OPENDIR:
+		return libtfs_open(fs, op->path);			// tfs_opendir() makes the same call
+	case TFS_OP_DEFRAG:
+		return libtfs_defrag(fs);
+	}
+	return -ENOSYS;
+}
+
+/*
+ * p-th percentile of a sorted array, in microseconds.
+ */
+static double percentile_us(const uint64_t* sorted, int count, int p) {
+	int index = (int)((long)count * p / 100);
+	if(index >= count){
+		index = count - 1;
+	}
+	return sorted[index] / 1000.0;
+}
+
+static void print_stats(struct op_stats* stats, int nops, uint64_t wall_ns, uint64_t bytes_read, uint64_t bytes_written) {
+	printf("%-10s %8s %6s %10s %10s %10s %10s %10s\n", "op", "count", "diff", "orig p50", "p50", "p90", "p99", "max");
+	int op = 0;
+	for(op = 1; op < TFS_OP_MAX; op++){
+		struct op_stats* s = &stats[op];
+		if(s->count == 0){
+			continue;
+		}
+		qsort(s->orig_ns, s->count, sizeof(uint64_t), cmp_u64);
+		qsort(s->replay_ns, s->count, sizeof(uint64_t), cmp_u64);
+		printf("%-10s %8d %6d %8.1fus %8.1fus %8.1fus %8.1fus %8.1fus\n", op_names[op], s->count, s->mismatches,
+		       percentile_us(s->orig_ns, s->count, 50), percentile_us(s->replay_ns, s->count, 50),
+		       percentile_us(s->replay_ns, s->count, 90), percentile_us(s->replay_ns, s->count, 99),
+		       s->replay_ns[s->count - 1] / 1000.0);
+	}
+
+	double secs = wall_ns / 1e9;
+	printf("%d operations in %.3fs (%.0f ops/s), read %.1f MB/s, wrote %.1f MB/s\n", nops, secs, secs > 0 ? nops / secs : 0.0,
+	       secs > 0 ? bytes_read / secs / (1 << 20) : 0.0, secs > 0 ? bytes_written / secs / (1 << 20) : 0.0);
+}
+
+static void usage() {
+	fprintf(stderr, "usage: tfs_replay [-p] [-o csum_data,compress,dedup,odirect,sparse,commit_sync] TRACE IMAGE\n");
+}
+
+int main(int argc, char *argv[]) {
+	int paced = 0;
+	char* opt_list = NULL;
+	int c = 0;
+	while((c = getopt(argc, argv, "po:")) != -1){
+		if(c == 'p'){
+			paced = 1;
+		}
+		else if(c == 'o'){
+			opt_list = optarg;
+		}
+		else{
+			usage();
+			return 1;
+		}
+	}
+	if(argc - optind != 2){
+		usage();
+		return 1;
+	}
+	const char* trace_path = argv[optind];
+	const char* image_path = argv[optind + 1];
+
+	// Step 1: Load the trace
+	struct tfs_trace_header header;
+	struct replay_op* ops = NULL;
+	int nops = load_trace(trace_path, &header, &ops);
+	if(nops < 0){
+		return 1;
+	}
+
+	// Step 2: Same options as the recording unless -o says otherwise
+	struct tfs_options opts;
+	memset(&opts, 0, sizeof(opts));
+	if(opt_list == NULL){
+		opts.csum_data = (header.flags & TFS_TRACE_OPT_CSUM) != 0;
+		opts.compress = (header.flags & TFS_TRACE_OPT_COMPRESS) != 0;
+		opts.dedup = (header.flags & TFS_TRACE_OPT_DEDUP) != 0;
+		opts.direct_io = (header.flags & TFS_TRACE_OPT_ODIRECT) != 0;
+		opts.sparse = (header.flags & TFS_TRACE_OPT_SPARSE) != 0;
+		opts.commit_sync = (header.flags & TFS_TRACE_OPT_COMMIT_SYNC) != 0;
+	}
+	else{
+		char* name = strtok(opt_list, ",");
+		while(name != NULL){
+			if(strcmp(name, "csum_data") == 0){
+				opts.csum_data = 1;
+			}
+			else if(strcmp(name, "compress") == 0){
+				opts.compress = 1;
+			}
+			else if(strcmp(name, "dedup") == 0){
+				opts.dedup = 1;
+			}
+			else if(strcmp(name, "odirect") == 0){
+				opts.direct_io = 1;
+			}
+			else if(strcmp(name, "sparse") == 0){
+				opts.sparse = 1;
+			}
+			else if(strcmp(name, "commit_sync") == 0){
+				opts.commit_sync = 1;
+			}
+			else if(name[0] != '\0'){
+				fprintf(stderr, "tfs_replay: unknown option %s\n", name);
+				return 1;
+			}
+			name = strtok(NULL, ",");
+		}
+	}
+
+	// Step 3: Start from a fresh image, the trace's first operations expect an empty file system
+	if(access(image_path, F_OK) == 0){
+		fprintf(stderr, "tfs_replay: %s already exists, replay needs a fresh image\n", image_path);
+		return 1;
+	}
+	struct tfs_fs* fs = libtfs_mount(image_path, &opts);
+	if(fs == NULL){
+		fprintf(stderr, "tfs_replay: can't create %s (%s)\n", image_path, strerror(errno));
+		return 1;
+	}
+
+	// Step 4: Run every operation, waiting for its recorded start time under -p
+	size_t data_size = LIBTFS_MAX_EXTENTS * 4096;
+	int i = 0;
+	for(i = 0; i < nops; i++){
+		if((ops[i].rec.op == TFS_OP_READ || ops[i].rec.op == TFS_OP_WRITE) && ops[i].rec.size > data_size){
+			data_size = ops[i].rec.size;
+		}
+	}
+	char* data = (char*)malloc(data_size);
+	for(i = 0; i < (int)data_size; i++){
+		data[i] = "tfs replay data\n"[i % 16];
+	}
+
+	struct op_stats stats[TFS_OP_MAX];
+	memset(stats, 0, sizeof(stats));
+	for(i = 0; i < nops; i++){
+		struct op_stats* s = &stats[ops[i].rec.op];
+		if(s->orig_ns == NULL){
+			s->orig_ns = (uint64_t*)malloc(nops * sizeof(uint64_t));
+			s->replay_ns = (uint64_t*)malloc(nops * sizeof(uint64_t));
+		}
+	}
+
+	uint64_t bytes_read = 0;
+	uint64_t bytes_written = 0;
+	uint64_t replay_start = now_ns();
+	for(i = 0; i < nops; i++){
+		const struct tfs_trace_rec* rec = &ops[i].rec;
+		if(paced){
+			uint64_t due = replay_start + rec->start_ns;
+			uint64_t now = now_ns();
+			if(due > now){
+				struct timespec wait = { (time_t)((due - now) / 1000000000ULL), (long)((due - now) % 1000000000ULL) };
+				nanosleep(&wait, NULL);
+			}
+		}
+
+		uint64_t start = now_ns();
+		int ret = replay_one(fs, &ops[i], data);
+		uint64_t took = now_ns() - start;
+
+		struct op_stats* s = &stats[rec->op];
+		s->orig_ns[s->count] = rec->dur_ns;
+		s->replay_ns[s->count] = took;
+		s->count++;
+		// Reads and writes only have to agree on failing or not, the byte counts depend on the FUSE path taken.
+		if((rec->op == TFS_OP_READ || rec->op == TFS_OP_WRITE) ? ((ret < 0) != (rec->ret < 0)) : (ret != rec->ret)){
+			s->mismatches++;
+		}
+		if(rec->op == TFS_OP_READ && ret > 0){
+			bytes_read += ret;
+		}
+		if(rec->op == TFS_OP_WRITE && ret > 0){
+			bytes_written += ret;
+		}
+	}
+	uint64_t wall_ns = now_ns() - replay_start;
+
+	// Step 5: Report, then clean up
+	print_stats(stats, nops, wall_ns, bytes_read, bytes_written);
+	libtfs_unmount(fs);
+
+	for(i = 0; i < TFS_OP_MAX; i++){
+		free(stats[i].orig_ns);
+		free(stats[i].replay_ns);
+	}
+	for(i = 0; i < nops; i++){
+		free(ops[i].path);
+		free(ops[i].path2);
+	}
+	free(ops);
+	free(data);
+	return 0;
+}
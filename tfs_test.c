@@ -0,0 +1,617 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	tfs_test.c
+ *  Author: Yujie REN
+ *	Date:	April 2019
+ *
+ *	Crash-consistency and block I/O regression tests for libtfs. Each operation under test is run once to
+ *	count its block writes and check them against a budget, then once more for every one of those writes with
+ *	libtfs_set_fault() crashing the handle right there. After each crash the image is mounted again and has to
+ *	pass libtfs_check(), with the operation either fully done or not done at all.
+ *
+ *	Build:	gcc -o tfs_test tfs_test.c libtfs.o -lpthread
+ *	Usage:	tfs_test [-v] [DIR]
+ *
+ *	Images are made in DIR, /dev/shm by default so they never leave memory. -v prints every check and
+ *	what libtfs_check() finds. Exits with 1 if any check failed, so it can gate a build.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+
+#include "libtfs.h"
+
+#define TEST_FILE_SIZE		(5 * 4096 + 100)	// five full blocks and a partial one, two compression chunks
+#define TEST_DIR_FILL		16			// entries that fill a directory's first block
+#define TEST_BIG_DIR		40			// entries for the directory test, three blocks' worth
+#define TEST_DISCARD_FILES	4			// 16-block files whose unlinks make up a batch of freed blocks to punch out
+
+static char image_path[PATH_MAX];
+static int verbose = 0;
+static int checks = 0;
+static int failures = 0;
+static char pattern[TEST_FILE_SIZE];
+static char repattern[TEST_FILE_SIZE];		// what the file is overwritten with
+
+static void expect(int ok, const char* fmt, ...) {
+	checks++;
+	if(ok && !verbose){
+		return;
+	}
+	failures += !ok;
+	va_list args;
+	va_start(args, fmt);
+	printf("%s: ", ok ? "ok" : "FAIL");
+	vprintf(fmt, args);
+	putchar('\n');
+	va_end(args);
+}
+
+static int count_entries(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	(*(int*)buf)++;
+	return 0;
+}
+
+static int exists(struct tfs_fs* fs, const char* path) {
+	struct stat st;
+	return libtfs_getattr(fs, path, &st) == 0;
+}
+
+/*
+ * The steps. Each one runs on an image that has been through all the steps before it.
+ */
+static int step_mkdir(struct tfs_fs* fs) {
+	return libtfs_mkdir(fs, "/d", 0755);
+}
+
+static int step_create(struct tfs_fs* fs) {
+	return libtfs_create(fs, "/d/f", 0644);
+}
+
+static int step_write(struct tfs_fs* fs) {
+	int ret = libtfs_write(fs, "/d/f", pattern, TEST_FILE_SIZE, 0);
+	return (ret == TEST_FILE_SIZE) ? 0 : -EIO;
+}
+
+static int step_read(struct tfs_fs* fs) {
+	char buf[TEST_FILE_SIZE];
+	int ret = libtfs_read(fs, "/d/f", buf, TEST_FILE_SIZE, 0);
+	return (ret == TEST_FILE_SIZE && memcmp(buf, pattern, TEST_FILE_SIZE) == 0) ? 0 : -EIO;
+}
+
+static int step_rewrite(struct tfs_fs* fs) {
+	int ret = libtfs_write(fs, "/d/f", repattern, TEST_FILE_SIZE, 0);
+	return (ret == TEST_FILE_SIZE) ? 0 : -EIO;
+}
+
+static int step_fill(struct tfs_fs* fs) {
+	char name[32];
+	int i = 0;
+	for(i = 0; i < TEST_DIR_FILL - 1; i++){		// "f" is already there
+		snprintf(name, sizeof(name), "/d/e%02d", i);
+		int ret = libtfs_create(fs, name, 0644);
+		if(ret != 0){
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int step_grow(struct tfs_fs* fs) {
+	return libtfs_create(fs, "/d/g", 0644);		// doesn't fit in the first block anymore
+}
+
+static int step_readdir(struct tfs_fs* fs) {
+	int entries = 0;
+	int ret = libtfs_readdir(fs, "/d", &entries, count_entries);
+	return (ret == 0 && entries == TEST_DIR_FILL + 1) ? 0 : -EIO;
+}
+
+static int step_unlink(struct tfs_fs* fs) {
+	return libtfs_unlink(fs, "/d/f");
+}
+
+static int step_empty(struct tfs_fs* fs) {
+	char name[32];
+	int i = 0;
+	for(i = 0; i < TEST_DIR_FILL - 1; i++){
+		snprintf(name, sizeof(name), "/d/e%02d", i);
+		int ret = libtfs_unlink(fs, name);
+		if(ret != 0){
+			return ret;
+		}
+	}
+	return libtfs_unlink(fs, "/d/g");
+}
+
+static int step_rmdir(struct tfs_fs* fs) {
+	return libtfs_rmdir(fs, "/d");
+}
+
+/*
+ * After a crash in the middle of a step: 1 if its result is there, 0 if the image looks like it never ran,
+ * -1 for anything in between.
+ */
+static int done_mkdir(struct tfs_fs* fs) {
+	return exists(fs, "/d");
+}
+
+static int done_create(struct tfs_fs* fs) {
+	return exists(fs, "/d/f");
+}
+
+static int done_write(struct tfs_fs* fs) {
+	struct stat st;
+	if(libtfs_getattr(fs, "/d/f", &st) != 0){
+		return -1;
+	}
+	if(st.st_size == 0){
+		return 0;
+	}
+	return (st.st_size == TEST_FILE_SIZE && step_read(fs) == 0) ? 1 : -1;
+}
+
+static int done_rewrite(struct tfs_fs* fs) {
+	char buf[TEST_FILE_SIZE];
+	if(libtfs_read(fs, "/d/f", buf, TEST_FILE_SIZE, 0) != TEST_FILE_SIZE){
+		return -1;
+	}
+	if(memcmp(buf, pattern, TEST_FILE_SIZE) == 0){
+		return 0;
+	}
+	return (memcmp(buf, repattern, TEST_FILE_SIZE) == 0) ? 1 : -1;
+}
+
+static int done_grow(struct tfs_fs* fs) {
+	return exists(fs, "/d/g");
+}
+
+static int done_unlink(struct tfs_fs* fs) {
+	return !exists(fs, "/d/f");
+}
+
+static int done_rmdir(struct tfs_fs* fs) {
+	return !exists(fs, "/d");
+}
+
+/*
+ * Block I/O budgets are what the step takes on a freshly mounted image, journal included. Raise one only
+ * together with the change that needs it. Steps without a done() are setup and only have to succeed.
+ */
+struct test_step {
+	const char*	name;
+	int		(*run)(struct tfs_fs* fs);
+	int		(*done)(struct tfs_fs* fs);
+	unsigned long	max_reads;
+	unsigned long	max_writes;
+};
+
+static const struct test_step steps[] = {
+	{ "mkdir",	step_mkdir,	done_mkdir,	7,	15 },
+	{ "create",	step_create,	done_create,	8,	11 },
+	{ "write",	step_write,	done_write,	7,	13 },
+	{ "read",	step_read,	NULL,		11,	0 },
+	{ "rewrite",	step_rewrite,	done_rewrite,	7,	11 },
+	{ "fill",	step_fill,	NULL,		0,	0 },
+	{ "grow",	step_grow,	done_grow,	9,	13 },
+	{ "readdir",	step_readdir,	NULL,		5,	0 },
+	{ "unlink",	step_unlink,	done_unlink,	12,	11 },
+	{ "empty",	step_empty,	NULL,		0,	0 },
+	{ "rmdir",	step_rmdir,	done_rmdir,	10,	11 },
+};
+
+#define NSTEPS		((int)(sizeof(steps) / sizeof(steps[0])))
+
+/*
+ * Mount options the crash matrix runs under. The I/O budgets are only held against the first one.
+ */
+struct test_mode {
+	const char*	name;
+	int		sparse;
+	int		csum_data;
+	int		compress;
+};
+
+static const struct test_mode modes[] = {
+	{ "default",		0,	0,	0 },
+	{ "sparse",		1,	0,	0 },
+	{ "csum_data",		0,	1,	0 },
+	{ "compress",		0,	0,	1 },
+	{ "csum_data,compress",	0,	1,	1 },
+};
+
+#define NMODES		((int)(sizeof(modes) / sizeof(modes[0])))
+
+static void mode_options(const struct test_mode* mode, struct tfs_options* opts) {
+	memset(opts, 0, sizeof(*opts));
+	opts->sparse = mode->sparse;
+	opts->csum_data = mode->csum_data;
+	opts->compress = mode->compress;
+}
+
+/*
+ * A fresh image that has been through steps [0, upto), mounted again so no caches are warm. NULL on failure.
+ */
+static struct tfs_fs* build_image(int upto, const struct tfs_options* opts) {
+	unlink(image_path);
+	struct tfs_fs* fs = libtfs_mount(image_path, opts);
+	if(fs == NULL){
+		return NULL;
+	}
+	int k = 0;
+	for(k = 0; k < upto; k++){
+		int ret = steps[k].run(fs);
+		if(ret != 0){
+			printf("FAIL: setup step %s returned %d\n", steps[k].name, ret);
+			libtfs_unmount(fs);
+			return NULL;
+		}
+	}
+	libtfs_unmount(fs);
+	return libtfs_mount(image_path, opts);
+}
+
+/*
+ * Run step k on a fresh image and hold it to its I/O budget (with the default options). Returns the number of
+ * block writes it made.
+ */
+static long test_budget(int k, const struct test_mode* mode) {
+	struct tfs_options opts;
+	mode_options(mode, &opts);
+	struct tfs_fs* fs = build_image(k, &opts);
+	if(fs == NULL){
+		expect(0, "%s (%s): can't build the image", steps[k].name, mode->name);
+		return -1;
+	}
+	const struct tfs_stats* stats = libtfs_get_stats(fs);
+	unsigned long reads = stats->dev_reads;
+	unsigned long writes = stats->dev_writes;
+	int ret = steps[k].run(fs);
+	reads = stats->dev_reads - reads;
+	writes = stats->dev_writes - writes;
+	expect(ret == 0, "%s (%s) returns 0 (got %d)", steps[k].name, mode->name, ret);
+	if(mode == &modes[0] && (steps[k].done != NULL || steps[k].max_reads > 0)){
+		expect(reads <= steps[k].max_reads, "%s reads %lu blocks, budget %lu", steps[k].name, reads, steps[k].max_reads);
+		expect(writes <= steps[k].max_writes, "%s writes %lu blocks, budget %lu", steps[k].name, writes, steps[k].max_writes);
+	}
+	int problems = libtfs_check(fs, verbose ? stdout : NULL);
+	expect(problems == 0, "%s (%s) leaves a clean image (%d problems)", steps[k].name, mode->name, problems);
+	libtfs_unmount(fs);
+	return writes;
+}
+
+/*
+ * Crash step k at each of its nwrites block writes, then mount the image again and check it. With reorder,
+ * the crash also takes back some of the last writes, which only commit_sync's barriers can keep in order.
+ */
+static void test_crashes(int k, const struct test_mode* mode, long nwrites, int reorder) {
+	struct tfs_options opts;
+	mode_options(mode, &opts);
+	opts.commit_sync = (reorder > 0);
+	long crash_after = 0;
+	for(crash_after = 0; crash_after < nwrites; crash_after++){
+		struct tfs_fs* fs = build_image(k, &opts);
+		if(fs == NULL){
+			expect(0, "%s (%s): can't build the image", steps[k].name, mode->name);
+			return;
+		}
+		struct tfs_fault fault = { crash_after, reorder, 0, (unsigned)(k * 1000 + crash_after) };
+		libtfs_set_fault(fs, &fault);
+		steps[k].run(fs);
+		int crashed = libtfs_crashed(fs);
+		libtfs_unmount(fs);
+		expect(crashed, "%s (%s) crashes after write %ld (reorder %d)", steps[k].name, mode->name, crash_after, reorder);
+
+		fs = libtfs_mount(image_path, &opts);
+		if(fs == NULL){
+			expect(0, "%s (%s) crashed after write %ld (reorder %d): image doesn't mount", steps[k].name, mode->name, crash_after, reorder);
+			continue;
+		}
+		int problems = libtfs_check(fs, verbose ? stdout : NULL);
+		int done = steps[k].done(fs);
+		expect(problems == 0, "%s (%s) crashed after write %ld (reorder %d): %d problems", steps[k].name, mode->name, crash_after, reorder, problems);
+
+		// File data is overwritten in place unless csum_data makes it copy-on-write, only then is a rewrite all or nothing.
+		if(steps[k].done != done_rewrite || mode->csum_data){
+			expect(done != -1, "%s (%s) crashed after write %ld (reorder %d): half done", steps[k].name, mode->name, crash_after, reorder);
+		}
+		libtfs_unmount(fs);
+	}
+}
+
+/*
+ * With sparse, the unlink that fills up a batch of freed blocks also punches them out of the disk file. A crash
+ * anywhere in it still has to leave the file either there or gone, with nothing freed twice or leaked.
+ */
+static struct tfs_fs* discard_image(const struct tfs_options* opts) {
+	static char data[16 * 4096];
+	memset(data, 'z', sizeof(data));
+	unlink(image_path);
+	struct tfs_fs* fs = libtfs_mount(image_path, opts);
+	char name[32];
+	int i = 0;
+	for(i = 0; fs != NULL && i < TEST_DISCARD_FILES; i++){
+		snprintf(name, sizeof(name), "/z%d", i);
+		if(libtfs_create(fs, name, 0644) != 0 || libtfs_write(fs, name, data, sizeof(data), 0) != (int)sizeof(data)){
+			libtfs_unmount(fs);
+			return NULL;
+		}
+	}
+	for(i = 0; fs != NULL && i < TEST_DISCARD_FILES - 1; i++){
+		snprintf(name, sizeof(name), "/z%d", i);
+		libtfs_unlink(fs, name);
+	}
+	return fs;				// not mounted again, or the queue of freed blocks would be punched out already
+}
+
+static void test_discard_crashes() {
+	struct tfs_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.sparse = 1;
+	char last[32];
+	snprintf(last, sizeof(last), "/z%d", TEST_DISCARD_FILES - 1);
+
+	struct tfs_fs* fs = discard_image(&opts);
+	if(fs == NULL){
+		expect(0, "discard: can't build the image");
+		return;
+	}
+	const struct tfs_stats* stats = libtfs_get_stats(fs);
+	unsigned long writes = stats->dev_writes;
+	int ret = libtfs_unlink(fs, last);
+	long nwrites = stats->dev_writes - writes;
+	expect(ret == 0 && stats->discarded_blocks > 0, "discard: unlink returns %d and punches out %lu blocks", ret, stats->discarded_blocks);
+	libtfs_unmount(fs);
+
+	long crash_after = 0;
+	for(crash_after = 0; crash_after < nwrites; crash_after++){
+		fs = discard_image(&opts);
+		if(fs == NULL){
+			expect(0, "discard: can't build the image");
+			return;
+		}
+		struct tfs_fault fault = { crash_after, 0, 0, (unsigned)crash_after };
+		libtfs_set_fault(fs, &fault);
+		libtfs_unlink(fs, last);
+		int crashed = libtfs_crashed(fs);
+		libtfs_unmount(fs);
+		expect(crashed, "discard: unlink crashes after write %ld", crash_after);
+
+		fs = libtfs_mount(image_path, &opts);
+		if(fs == NULL){
+			expect(0, "discard: unlink crashed after write %ld: image doesn't mount", crash_after);
+			continue;
+		}
+		int problems = libtfs_check(fs, verbose ? stdout : NULL);
+		expect(problems == 0, "discard: unlink crashed after write %ld: %d problems", crash_after, problems);
+		libtfs_unmount(fs);
+	}
+}
+
+/*
+ * A directory with more entries than one block holds, across a remount and a compaction.
+ */
+static void test_big_dir() {
+	struct tfs_options opts;
+	memset(&opts, 0, sizeof(opts));
+	unlink(image_path);
+	struct tfs_fs* fs = libtfs_mount(image_path, &opts);
+	if(fs == NULL){
+		expect(0, "big dir: can't make the image");
+		return;
+	}
+	char name[32];
+	int made = 0;
+	int i = 0;
+	libtfs_mkdir(fs, "/big", 0755);
+	for(i = 0; i < TEST_BIG_DIR; i++){
+		snprintf(name, sizeof(name), "/big/f%02d", i);
+		made += (libtfs_create(fs, name, 0644) == 0 && libtfs_write(fs, name, name, strlen(name), 0) == (int)strlen(name));
+	}
+	expect(made == TEST_BIG_DIR, "big dir: %d of %d files made", made, TEST_BIG_DIR);
+	libtfs_unmount(fs);
+
+	// Every name has to come back after a remount, contents and all.
+	fs = libtfs_mount(image_path, &opts);
+	int entries = 0;
+	libtfs_readdir(fs, "/big", &entries, count_entries);
+	expect(entries == TEST_BIG_DIR, "big dir: readdir lists %d entries after a remount", entries);
+	int found = 0;
+	for(i = 0; i < TEST_BIG_DIR; i++){
+		char buf[32];
+		memset(buf, 0, sizeof(buf));
+		snprintf(name, sizeof(name), "/big/f%02d", i);
+		found += (libtfs_read(fs, name, buf, sizeof(buf), 0) == (int)strlen(name) && strcmp(buf, name) == 0);
+	}
+	expect(found == TEST_BIG_DIR, "big dir: %d of %d files read back", found, TEST_BIG_DIR);
+	int problems = libtfs_check(fs, verbose ? stdout : NULL);
+	expect(problems == 0, "big dir: %d problems after a remount", problems);
+
+	// Drop every other one and compact the directory.
+	for(i = 0; i < TEST_BIG_DIR; i += 2){
+		snprintf(name, sizeof(name), "/big/f%02d", i);
+		libtfs_unlink(fs, name);
+	}
+	libtfs_defrag(fs);
+	libtfs_unmount(fs);
+	fs = libtfs_mount(image_path, &opts);
+	entries = 0;
+	libtfs_readdir(fs, "/big", &entries, count_entries);
+	expect(entries == TEST_BIG_DIR / 2, "big dir: readdir lists %d entries after compaction", entries);
+	for(i = 0, found = 0; i < TEST_BIG_DIR; i++){
+		snprintf(name, sizeof(name), "/big/f%02d", i);
+		found += (exists(fs, name) == (i % 2));
+	}
+	expect(found == TEST_BIG_DIR, "big dir: %d of %d names right after compaction", found, TEST_BIG_DIR);
+	problems = libtfs_check(fs, verbose ? stdout : NULL);
+	expect(problems == 0, "big dir: %d problems after compaction", problems);
+	libtfs_unmount(fs);
+}
+
+/*
+ * Calls that have to fail, and with what.
+ */
+static void test_errors() {
+	struct tfs_options opts;
+	memset(&opts, 0, sizeof(opts));
+	unlink(image_path);
+	struct tfs_fs* fs = libtfs_mount(image_path, &opts);
+	if(fs == NULL){
+		expect(0, "errors: can't make the image");
+		return;
+	}
+	char long_path[PATH_MAX];
+	memset(long_path, 'a', sizeof(long_path) - 1);
+	long_path[0] = '/';
+	long_path[sizeof(long_path) - 1] = '\0';
+	struct stat st;
+	char buf[16];
+	int ret = libtfs_getattr(fs, long_path, &st);
+	expect(ret == -ENAMETOOLONG, "errors: getattr on a %d-byte path returns %d", (int)strlen(long_path), ret);
+	ret = libtfs_read(fs, long_path, buf, sizeof(buf), 0);
+	expect(ret == -ENAMETOOLONG, "errors: read on a %d-byte path returns %d", (int)strlen(long_path), ret);
+	ret = libtfs_getattr(fs, "/nothing", &st);
+	expect(ret == -ENOENT, "errors: getattr on a missing file returns %d", ret);
+
+	// A regular file in the middle of a path isn't a directory, whatever is asked of it.
+	libtfs_create(fs, "/file", 0644);
+	libtfs_create(fs, "/src", 0644);
+	ret = libtfs_rename(fs, "/src", "/file/x");
+	expect(ret == -ENOTDIR, "errors: rename into a regular file returns %d", ret);
+	expect(exists(fs, "/src"), "errors: rename into a regular file leaves the source alone");
+	ret = libtfs_clone(fs, "/src", "/file/x");
+	expect(ret == -ENOTDIR, "errors: clone into a regular file returns %d", ret);
+	ret = libtfs_getattr(fs, "/file/x", &st);
+	expect(ret == -ENOTDIR, "errors: getattr through a regular file returns %d", ret);
+
+	// A clone can't take a name that's already there, even with a dead entry in front of it.
+	libtfs_create(fs, "/dead", 0644);
+	libtfs_create(fs, "/taken", 0644);
+	libtfs_unlink(fs, "/dead");
+	ret = libtfs_clone(fs, "/src", "/taken");
+	expect(ret == -EEXIST, "errors: clone onto an existing name returns %d", ret);
+	int entries = 0;
+	libtfs_readdir(fs, "/", &entries, count_entries);
+	expect(entries == 3, "errors: readdir lists %d entries after the clone failed", entries);
+
+	int problems = libtfs_check(fs, verbose ? stdout : NULL);
+	expect(problems == 0, "errors: %d problems", problems);
+	libtfs_unmount(fs);
+}
+
+/*
+ * Extents from libtfs_read_extents() have to keep pointing at the file's data after it is unlinked and
+ * another file is written, since FUSE splices them after the call has returned.
+ */
+static void test_extents() {
+	struct tfs_options opts;
+	memset(&opts, 0, sizeof(opts));
+	unlink(image_path);
+	struct tfs_fs* fs = libtfs_mount(image_path, &opts);
+	if(fs == NULL){
+		expect(0, "extents: can't make the image");
+		return;
+	}
+	libtfs_create(fs, "/old", 0644);
+	libtfs_write(fs, "/old", pattern, TEST_FILE_SIZE, 0);
+	struct libtfs_extent ext[LIBTFS_MAX_EXTENTS];
+	int count = libtfs_read_extents(fs, "/old", 0, TEST_FILE_SIZE, ext);
+	expect(count > 0, "extents: read_extents returns %d", count);
+	libtfs_unlink(fs, "/old");
+	libtfs_create(fs, "/new", 0644);
+	libtfs_write(fs, "/new", repattern, TEST_FILE_SIZE, 0);
+
+	// Step 1: Read through the extents the way a splice would
+	char* buf = (char*)malloc(TEST_FILE_SIZE);
+	size_t done = 0;
+	int i = 0;
+	for(i = 0; i < count && buf != NULL; i++){
+		if(ext[i].fd < 0){
+			memset(buf + done, 0, ext[i].len);
+		}
+		else if(pread(ext[i].fd, buf + done, ext[i].len, ext[i].pos) != (ssize_t)ext[i].len){
+			break;
+		}
+		done += ext[i].len;
+	}
+	expect(buf != NULL && done == TEST_FILE_SIZE && memcmp(buf, pattern, TEST_FILE_SIZE) == 0,
+		"extents: %d of %d bytes still read as the unlinked file", (int)done, TEST_FILE_SIZE);
+	free(buf);
+
+	int problems = libtfs_check(fs, verbose ? stdout : NULL);
+	expect(problems == 0, "extents: %d problems", problems);
+	libtfs_unmount(fs);
+}
+
+static void usage() {
+	fprintf(stderr, "usage: tfs_test [-v] [DIR]\n");
+}
+
+int main(int argc, char *argv[]) {
+	int c = 0;
+	while((c = getopt(argc, argv, "v")) != -1){
+		if(c == 'v'){
+			verbose = 1;
+		}
+		else{
+			usage();
+			return 1;
+		}
+	}
+	if(argc - optind > 1){
+		usage();
+		return 1;
+	}
+	const char* dir = (argc - optind == 1) ? argv[optind] : "/dev/shm";
+	if(snprintf(image_path, sizeof(image_path), "%s/tfs_test.%d", dir, (int)getpid()) >= (int)sizeof(image_path)){
+		fprintf(stderr, "tfs_test: %s is too long\n", dir);
+		return 1;
+	}
+	int i = 0;
+	for(i = 0; i < TEST_FILE_SIZE; i++){
+		pattern[i] = (char)(i % 251);
+		repattern[i] = (char)(i % 253 + 1);
+	}
+
+	// Step 1: Every step on its own, under every mode: budgets, then a crash at each of its writes, in order and reordered
+	int m = 0;
+	for(m = 0; m < NMODES; m++){
+		int k = 0;
+		for(k = 0; k < NSTEPS; k++){
+			long nwrites = test_budget(k, &modes[m]);
+			if(steps[k].done == NULL || nwrites <= 0){
+				continue;
+			}
+			test_crashes(k, &modes[m], nwrites, 0);
+			test_crashes(k, &modes[m], nwrites, 8);
+		}
+	}
+
+	// Step 2: Freed blocks punched out of a sparse image
+	test_discard_crashes();
+
+	// Step 3: Directories that outgrow their first block
+	test_big_dir();
+
+	// Step 4: Calls that have to fail
+	test_errors();
+
+	// Step 5: Zero-copy extents outliving an unlink
+	test_extents();
+
+	unlink(image_path);
+	printf("tfs_test: %d checks, %d failed\n", checks, failures);
+	return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	tfs_trace.h
+ *  Author: Yujie REN
+ *	Date:	April 2019
+ *
+ *	Format of the operation traces tfs.c records under -o trace=FILE, and tfs_replay reads back.
+ *	A trace is a struct tfs_trace_header followed by records, each a struct tfs_trace_rec and then
+ *	path_len bytes of path and path2_len bytes of second path (no terminating zeroes). Everything is
+ *	in host byte order, so a trace is replayed on the kind of machine that recorded it.
+ *
+ */
+
+#ifndef _TFS_TRACE_H
+#define _TFS_TRACE_H
+
+#include <stdint.h>
+
+#define TFS_TRACE_MAGIC		"TFSTRACE"
+#define TFS_TRACE_VERSION	1
+
+struct tfs_trace_header {
+	char		magic[8];		// TFS_TRACE_MAGIC
+	uint32_t	version;		// TFS_TRACE_VERSION
+	uint32_t	flags;			// the tfs_options the trace was recorded with, see TFS_TRACE_OPT_*
+};
+
+#define TFS_TRACE_OPT_CSUM	0x1
+#define TFS_TRACE_OPT_COMPRESS	0x2
+#define TFS_TRACE_OPT_DEDUP	0x4
+#define TFS_TRACE_OPT_ODIRECT	0x8
+#define TFS_TRACE_OPT_SPARSE	0x10
+#define TFS_TRACE_OPT_COMMIT_SYNC	0x20
+
+// Operations, one per FUSE callback (or ioctl) that reaches the file system. New ones only ever go at the end,
+// so older traces keep their meaning.
+enum tfs_trace_op {
+	TFS_OP_GETATTR = 1,
+	TFS_OP_OPEN,
+	TFS_OP_READDIR,
+	TFS_OP_MKDIR,
+	TFS_OP_RMDIR,
+	TFS_OP_CREATE,
+	TFS_OP_UNLINK,
+	TFS_OP_RENAME,			// path2 is the new name
+	TFS_OP_READ,
+	TFS_OP_WRITE,
+	TFS_OP_FLUSH,
+	TFS_OP_UTIMENS,			// offset/size hold atime/mtime packed with TFS_TRACE_TIME()
+	TFS_OP_CLONE,			// path2 is the clone
+	TFS_OP_FALLOCATE,		// mode holds the fallocate flags, size the length
+	TFS_OP_OPENDIR,
+	TFS_OP_DEFRAG,			// TFS_IOC_DEFRAG, ret is how many directories and files it fixed
+	TFS_OP_MAX
+};
+
+struct tfs_trace_rec {
+	uint8_t		op;			// enum tfs_trace_op
+	uint8_t		pad;
+	uint16_t	path_len;
+	uint16_t	path2_len;
+	uint16_t	pad2;
+	int32_t		ret;			// what the callback returned
+	uint32_t	mode;			// mkdir/create
+	uint64_t	offset;			// read/write
+	uint64_t	size;			// read/write
+	uint64_t	start_ns;		// when the callback started, counted from the start of the trace
+	uint64_t	dur_ns;			// how long it took
+};
+
+// A timespec in 64 bits: seconds above bit 30, nanoseconds (or UTIME_NOW/UTIME_OMIT, which both fit) below.
+#define TFS_TRACE_TIME(ts)	(((uint64_t)(ts).tv_sec << 30) | (uint64_t)(ts).tv_nsec)
+#define TFS_TRACE_SEC(t)	((time_t)((int64_t)(t) >> 30))
+#define TFS_TRACE_NSEC(t)	((long)((t) & ((1 << 30) - 1)))
+
+#endif